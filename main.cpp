@@ -3,8 +3,43 @@
 #include <cmath>
 #include <cstdarg>
 #include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
 #include <string>
-#include <list>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <future>
+#include <functional>
+#include <atomic>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
+#include <filesystem>
+#include <chrono>
+
+#if _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <winsock2.h>
+#include <afunix.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+#endif
 
 #include <opencv2/core.hpp>
 #include <opencv2/videoio.hpp>
@@ -14,10 +49,163 @@
 #include <tesseract/baseapi.h>
 
 #define WITH_VIDEO 0
+#define WITH_SQLITE 0
+// NOTE: libavformat/libavcodec/libswscale for the keyframe pass (--keyframes=1)
+#define WITH_LIBAV 0
+// NOTE: Per-stage timers and counters, reported at exit and on SIGUSR1 (SIGBREAK on Windows)
+#define WITH_STATS 1
+// NOTE: How long the daemon and batch loops wait at most before checking for a stats request
+#define STATS_POLL_INTERVAL_MS 250
 #define WAIT_DELAY_MS 15
 
+// NOTE: SSE2 is part of every x64 target, other targets use the scalar loops
+#if defined(__SSE2__) || defined(_M_X64)
+#define WITH_SSE2 1
+#else
+#define WITH_SSE2 0
+#endif
+
+#if WITH_SQLITE
+#include <sqlite3.h>
+#endif
+
+#if WITH_SSE2
+#include <emmintrin.h>
+#endif
+
+#if WITH_LIBAV
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+}
+#endif
+
+// NOTE: MeanTextConf is in [0, 100]; anything below this escalates to the next rung
+#define OCR_CONFIDENCE_THRESHOLD 75
+#define OCR_UPSCALE_FACTOR 2
+#define OCR_ALTERNATE_FRAME_STRIDE 6
+#define OCR_MAX_ALTERNATE_FRAMES 8
+#define OCR_SCAN_MAX_ROIS 8
+
+// NOTE: The ROIs of a screen after the first one are recognized on up to this many extra threads, each with its own
+// engine. By default only cores the scan workers leave idle get one.
+#define OCR_POOL_MAX_THREADS 3
+
+#define SCREEN_SIGNATURE_MAX_PIXELS 16
+
+// NOTE: All signature and ROI coordinates are given for a 1920x1080 game area and mapped into the viewport of a video
+#define REFERENCE_WIDTH 1920
+#define REFERENCE_HEIGHT 1080
+
+// NOTE: Rows and columns whose brightest pixel stays below CALIBRATION_BAR_LEVEL over the calibration frames are
+// letterbox bars. The viewport is fixed once it covered at least half the frame for CALIBRATION_FRAMES frames, after
+// CALIBRATION_MAX_FRAMES the whole frame is used.
+#define CALIBRATION_BAR_LEVEL 24
+#define CALIBRATION_FRAMES 15
+#define CALIBRATION_MAX_FRAMES 300
+
+// NOTE: A battle starts once its HUD was seen on BATTLE_START_FRAMES frames in a row and ends once the HUD is gone
+// for more than BATTLE_END_GAP_FRAMES (ultimate cutscenes and the pause menu hide it)
+#define BATTLE_START_FRAMES 5
+#define BATTLE_END_GAP_FRAMES 90
+
+// NOTE: Icons are compared as ICON_THUMB_SIZE^2 BGR thumbnails, a match needs a mean absolute difference
+// per channel of at most ICON_MAX_MEAN_DIFF
+#define ICON_THUMB_SIZE 16
+#define ICON_MAX_MEAN_DIFF 24
+
+// NOTE: HUD numbers are white, a pixel is ink if all channels are at least DIGIT_INK_THRESHOLD. Glyphs are compared
+// as DIGIT_GLYPH_WIDTH x DIGIT_GLYPH_HEIGHT masks, a glyph with a mean difference above DIGIT_MAX_MEAN_DIFF to every
+// template sends the field to tesseract.
+#define DIGIT_INK_THRESHOLD 200
+#define DIGIT_GLYPH_WIDTH 16
+#define DIGIT_GLYPH_HEIGHT 24
+#define DIGIT_GLYPH_BYTES (DIGIT_GLYPH_WIDTH * DIGIT_GLYPH_HEIGHT)
+#define DIGIT_MAX_MEAN_DIFF 48
+
+// NOTE: Timer and score readings per second of battle
+#define BATTLE_DEFAULT_SAMPLE_RATE 1.0
+
+#define OCR_DATA_PATH "."
+#define OCR_LANGUAGE "eng"
+// NOTE: Overlaps tesseract Init with decoding, but exit has to wait for it even if no screen was found
+#define OCR_BACKGROUND_WARMUP 0
+
+// NOTE: Batch files longer than this are split into segments that can be scanned in parallel
+#define BATCH_SEGMENT_FRAMES 36000
+// NOTE: Frames decoded before a segment start to establish the screen and battle hysteresis without emitting events,
+// long enough to see the HUD of a battle across a gap of BATTLE_END_GAP_FRAMES
+#define BATCH_SEGMENT_PREROLL_FRAMES 120
+#define BATCH_SMALL_FILE_BYTES (64ull << 20)
+#define BATCH_PACK_BYTES (512ull << 20)
+
+// NOTE: Seeks to a candidate range land this far before it. CAP_PROP_POS_MSEC seeks are only as exact as the
+// container's index, the preroll makes up for landing late, and gaps shorter than it are decoded instead.
+#define KEYFRAME_SEEK_PREROLL_MS 2000
+
+// NOTE: A client has this long to send its job line before the worker gives up on it
+#define DAEMON_RECV_TIMEOUT_MS 10000
+
+// NOTE: --frames=sheet draws every detected screen as a SHEET_TILE_WIDTH x SHEET_TILE_HEIGHT tile into one canvas
+// of SHEET_COLUMNS columns, the canvas is written as JPEG once it holds SHEET_MAX_TILES tiles or the scan ends
+#define SHEET_TILE_WIDTH 240
+#define SHEET_TILE_HEIGHT 135
+#define SHEET_COLUMNS 8
+#define SHEET_MAX_TILES 128
+#define SHEET_JPEG_QUALITY 85
+
+// NOTE: Clips start CLIP_LEAD_MS before a screen or battle and end CLIP_LEAD_MS after a battle, a screen clip lasts
+// CLIP_SCREEN_MS. ffmpeg cuts at the keyframe before the start, so clips may begin a little earlier.
+#define CLIP_FFMPEG "ffmpeg"
+#define CLIP_LEAD_MS 1000
+#define CLIP_SCREEN_MS 4000
+
+// NOTE: Events waiting for the sink, the buffer is drained into the sink whenever it fills up
+#define EVENT_BUFFER_CAPACITY 256
+#define EVENT_WRITER_BUFFER_BYTES (64 * 1024)
+#define EVENT_LINE_MAX_BYTES 2048
+#define EVENT_BLOCK_CAPACITY 4096
+// NOTE: Rows per SQLite transaction, a flush of the sink commits early
+#define SQLITE_BATCH_ROWS 1024
+
+// NOTE: Messages below LOG_COMPILED_LEVEL are compiled out, the rest is filtered by --log-level at runtime
+#define LOG_COMPILED_LEVEL LOG_LEVEL_DEBUG
+#define LOG_RING_BYTES (64 * 1024)
+#define LOG_RECORD_MAX_BYTES 1024
+#define LOG_FLUSH_INTERVAL_MS 20
+
+// NOTE: Log-linear latency buckets, 8 per power of two of microseconds
+#define STATS_LATENCY_SUB_BUCKETS 8
+#define STATS_LATENCY_BUCKETS 256
+// NOTE: Spans kept by --trace, the buffer is a ring and the oldest spans are overwritten once it is full
+#define TRACE_MAX_SPANS (1 << 20)
+
+// NOTE: Every --bench kernel runs for at least this long, the iteration count doubles until it does
+#define BENCH_MIN_NS 250000000ull
+// NOTE: A produced event matches an expected one of the same type and value at most this many frames apart
+#define EVAL_FRAME_TOLERANCE 15
+// NOTE: Values match if their case-insensitive edit distance is at most this fraction away from identical
+#define EVAL_MIN_SIMILARITY 0.8
+// NOTE: Every period of the synthetic video shows one battle, alternating between abyss and arena, and one screen of every kind
+#define SYNTH_PERIOD_SECONDS 20
+
 #define ARRAY_COUNT(x) (sizeof(x) / sizeof(x[0]))
 
+enum log_level_t {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_NONE,
+};
+
+enum log_files_t {
+    LOG_FILES_SHARED,
+    LOG_FILES_THREAD,
+    LOG_FILES_JOB,
+};
+
 enum event_type_t {
     EVENT_STIGMATA_SCREEN,
     EVENT_WEAPON_SCREEN,
@@ -32,21 +220,229 @@ enum event_type_t {
     EVENT_STIGMATA,
     EVENT_ELF,
     EVENT_DIVINE_KEY,
+    EVENT_BATTLE_TIMER,
+    EVENT_BATTLE_SCORE,
+
+    EVENT_TYPE_COUNT
+};
+
+// NOTE: Screens are tested in this order every frame, the first one that matches wins
+enum screen_t {
+    SCREEN_NONE = -1,
+    SCREEN_STIGMATA,
+    SCREEN_WEAPON,
+    SCREEN_DIVINE_KEY,
+    SCREEN_LINEUP,
+
+    SCREEN_COUNT
+};
+
+// NOTE: Battle HUDs are only tested on frames that are not a screen
+enum battle_t {
+    BATTLE_NONE = -1,
+    BATTLE_ABYSS,
+    BATTLE_ARENA,
+
+    BATTLE_COUNT
 };
 
+// NOTE: Fixed size and trivially copyable, so events can be stored contiguously and written out as-is.
+// Values are interned in the state's string table, id 0 is the empty string.
 struct event_t {
     event_type_t Type;
-    std::string  Value;
+    uint32_t ValueId;
+    int32_t Frame;
+    int32_t Ms;
+    int32_t Confidence;
 };
 
-struct state_t {
+struct string_table_t {
+    std::vector<char> Chars;
+    std::vector<uint32_t> Offsets;
+    std::unordered_map<std::string, uint32_t> Ids;
+};
+
+// NOTE: Rungs are ordered by cost, every ROI starts at the cheapest one
+enum ocr_rung_t {
+    OCR_RUNG_SINGLE_PASS,
+    OCR_RUNG_CONTRAST,
+    OCR_RUNG_UPSCALE,
+    OCR_RUNG_ALTERNATE_FRAME,
+    OCR_RUNG_UNRESOLVED,
+
+    OCR_RUNG_COUNT
+};
+
+enum ocr_preprocess_t {
+    OCR_PREPROCESS_CONTRAST_INVERT_GRAY,
+    OCR_PREPROCESS_INVERT_CONTRAST,
+};
+
+struct rect_t {
+    int X;
+    int Y;
     int Width;
     int Height;
-    cv::VideoCapture Capture;
+};
+
+// NOTE: The game area of a frame, the reference coordinates are scaled into it
+struct viewport_t {
+    int X;
+    int Y;
+    int Width;
+    int Height;
+};
+
+struct calibration_t {
+    bool Done;
+    int FrameWidth;
+    int FrameHeight;
+    int Frames;
+    int ValidFrames;
+    std::vector<uchar> RowMax;
+    std::vector<uchar> ColumnMax;
+};
+
+struct ocr_roi_t {
+    const char* Name;
+    rect_t Box;
+    ocr_preprocess_t Preprocess;
+    event_type_t EventType;
+    const char* Whitelist;
+    bool Resolved;
+    int Rung;
+    int Confidence;
+    float Contrast;
+    std::string Text;
+};
+
+// NOTE: The OCR of one screen appearance, kept across frames until every ROI is resolved or the
+// alternate frames run out
+struct ocr_scan_t {
+    bool Active;
+    int Screen;
+    int Frame;
+    double Ms;
+    int FramesSinceScan;
+    int AlternateFrames;
+    int RoiCount;
+    ocr_roi_t Rois[OCR_SCAN_MAX_ROIS];
+};
+
+// NOTE: Boundaries are backdated to the first and the last frame that showed the HUD
+struct battle_tracker_t {
+    int Battle;
+    int Candidate;
+    int CandidateFrames;
+    int FirstFrame;
+    double FirstMs;
+    int LastFrame;
+    double LastMs;
+    double NextSampleMs;
+};
+
+// NOTE: Ms is the presentation time of the keyframe, frame numbers would assume a constant frame rate
+struct keyframe_t {
+    double Ms;
+    bool Hit;
+};
+
+// NOTE: In presentation time like keyframe_t, EndMs < 0 reaches to the end of the file
+struct time_range_t {
+    double BeginMs;
+    double EndMs;
+};
+
+// NOTE: The canvas is allocated for SHEET_MAX_TILES tiles with the first tile and reused for every following sheet
+struct contact_sheet_t {
+    cv::Mat Canvas;
+    int TileCount;
+    int FirstFrame;
+};
+
+struct mapped_file_t {
+    const char* Data;
+    size_t Size;
+};
+
+// NOTE: Initialized on first use, either synchronously or by a warmup started with warm_ocr_engine
+struct ocr_engine_t {
     tesseract::TessBaseAPI Tess;
-    std::list<event_t> Events;
-    bool HadStigmataScreenIndicator;
-    bool HadLineupScreenIndicator;
+    std::future<bool> Warmup;
+    bool Initialized;
+    bool Failed;
+};
+
+enum output_format_t {
+    OUTPUT_TEXT,
+    OUTPUT_JSONL,
+    OUTPUT_BINARY,
+};
+
+enum flush_mode_t {
+    FLUSH_EVENT,
+    FLUSH_SCREEN,
+    FLUSH_END,
+};
+
+struct options_t {
+    std::string OutputDir;
+    bool DumpFrames;
+    bool ContactSheet;
+    int CheckpointInterval;
+    bool Resume;
+    flush_mode_t FlushMode;
+    output_format_t Format;
+    double BattleSampleRate;
+    std::string EventsPath;
+    std::string DatabasePath;
+    bool ExportClips;
+    std::string FfmpegPath;
+    bool KeyframePass;
+};
+
+struct event_sink_t;
+typedef void event_sink_write_t(event_sink_t* Sink, const event_t* Event, const char* Value);
+typedef void event_sink_flush_t(event_sink_t* Sink);
+
+// NOTE: File is only set for sinks backed by a regular file, those can be truncated back to a checkpoint on resume.
+// Sinks can be chained through Next, every event goes to all of them.
+struct event_sink_t {
+    event_sink_write_t* Write;
+    event_sink_flush_t* Flush;
+    FILE* File;
+    void* User;
+    event_sink_t* Next;
+};
+
+struct event_buffer_t {
+    event_t Events[EVENT_BUFFER_CAPACITY];
+    int First;
+    int Count;
+};
+
+struct state_t {
+    viewport_t Viewport;
+    calibration_t Calibration;
+    cv::VideoCapture Capture;
+    ocr_engine_t* Ocr;
+    const options_t* Options;
+    event_sink_t* Sink;
+    event_buffer_t Events;
+    string_table_t Strings;
+    int EmittedEvents;
+    int FrameIndex;
+    double FrameMs;
+    bool HadScreenIndicator[SCREEN_COUNT];
+    std::string CheckpointPath;
+    ocr_scan_t Scan;
+    battle_tracker_t Battle;
+    contact_sheet_t Sheet;
+    int DumpIndex[SCREEN_COUNT];
+    int OcrRungHistogram[OCR_RUNG_COUNT];
+    bool OcrFailed;
+    bool Cancelled;
+    std::string Error;
 };
 
 struct test_pixel_t {
@@ -55,11 +451,23 @@ struct test_pixel_t {
     uchar Color[3];
 };
 
-struct rect_t {
-    int X;
-    int Y;
-    int Width;
-    int Height;
+struct screen_signature_t {
+    const char* Name;
+    event_type_t EventType;
+    float Threshold;
+    int PixelCount;
+    test_pixel_t Pixels[SCREEN_SIGNATURE_MAX_PIXELS];
+    // NOTE: Unmeasured signatures are never classified, a "screen" line of --signatures=FILE measures one
+    bool Measured;
+};
+
+struct ocr_roi_layout_t {
+    const char* Name;
+    rect_t Box;
+    ocr_preprocess_t Preprocess;
+    event_type_t EventType;
+    // NOTE: Unmeasured ROIs are not read, a "roi" line of --signatures=FILE measures one
+    bool Measured;
 };
 
 struct image_t {
@@ -70,387 +478,5348 @@ struct image_t {
     int Pitch;
 };
 
-static void LOGMSG(const char* fmt, ...) {
-    static FILE* LogFile = fopen("Log.txt", "w");
-    if (LogFile) {
-        va_list args;
-        va_start(args, fmt);
-        vfprintf(LogFile, fmt, args);
-        va_end(args);
-    }
-}
+// NOTE: Every thread formats into its own single producer/single consumer ring, a background thread drains
+// all rings into the log files. Records are [uint32 Length][uint32 Target][Length bytes], a record with the
+// LOG_CLOSE_TARGET bit closes its target once everything logged to it before has been written.
+#define LOG_CLOSE_TARGET 0x80000000u
 
-static void OUTPUT(const char* fmt, ...) {
-    static FILE* Out = stdout;
-    if (Out) {
-        va_list args;
-        va_start(args, fmt);
-        vfprintf(Out, fmt, args);
-        fputc('\n', Out);
-        va_end(args);
-    }
-}
+struct log_ring_t {
+    char Data[LOG_RING_BYTES];
+    std::atomic<uint64_t> Head;
+    std::atomic<uint64_t> Tail;
+    std::atomic<bool> Retired;
+    uint32_t DefaultTarget;
+};
 
-static void log_timestamp(const cv::VideoCapture& Capture, const char* Msg) {
-    int FrameNum = (int)Capture.get(cv::CAP_PROP_POS_FRAMES);
-    int timer = (int)Capture.get(cv::CAP_PROP_POS_MSEC);
-    int milliseconds = timer % 1000; timer /= 1000;
-    int seconds = timer % 60; timer /= 60;
-    int minutes = timer % 60; timer /= 60;
-    int hours = timer;
-    LOGMSG("Frame number %d (%d:%02d:%02d:%03d): %s\n", FrameNum, hours, minutes, seconds, milliseconds, Msg);
-}
+struct logger_t {
+    std::mutex Mutex;
+    std::condition_variable Wake;
+    std::vector<log_ring_t*> Rings;
+    std::vector<FILE*> Targets;
+    std::thread Flusher;
+    bool Started;
+    bool Stop;
+};
 
-void add_event(state_t* State, event_type_t Type, const std::string& Value = std::string()) {
-    event_t Event;
-    Event.Type = Type;
-    Event.Value = Value;
-    State->Events.push_back(Event);
-}
+static logger_t Logger;
+static int LogLevel = LOG_LEVEL_INFO;
+static log_files_t LogFiles = LOG_FILES_SHARED;
 
-static float square(float x) {
-    return x * x;
+static void ring_copy_in(log_ring_t* Ring, uint64_t Position, const void* Src, uint32_t Size) {
+    uint32_t Offset = (uint32_t)(Position % LOG_RING_BYTES);
+    uint32_t First = std::min(Size, (uint32_t)LOG_RING_BYTES - Offset);
+    memcpy(Ring->Data + Offset, Src, First);
+    memcpy(Ring->Data, (const char*)Src + First, Size - First);
 }
 
-static int clamp(int a, int lower, int upper) {
-    return std::min(std::max(a, lower), upper);
+static void ring_copy_out(const log_ring_t* Ring, uint64_t Position, void* Dst, uint32_t Size) {
+    uint32_t Offset = (uint32_t)(Position % LOG_RING_BYTES);
+    uint32_t First = std::min(Size, (uint32_t)LOG_RING_BYTES - Offset);
+    memcpy(Dst, Ring->Data + Offset, First);
+    memcpy((char*)Dst + First, Ring->Data, Size - First);
 }
 
-static std::string replace_char(char* Str, char ToReplace, char ReplaceWith) {
-    char* Start = Str;
-    while (*Str) {
-        if (*Str == ToReplace) {
-            *Str = ReplaceWith;
+// NOTE: Returns false if the ring was empty, only ever called by the flusher thread
+static bool drain_log_ring(log_ring_t* Ring, std::vector<bool>* Dirty) {
+    uint64_t Tail = Ring->Tail.load(std::memory_order_relaxed);
+    uint64_t Head = Ring->Head.load(std::memory_order_acquire);
+    if (Tail == Head) {
+        return false;
+    }
+
+    char Text[LOG_RECORD_MAX_BYTES];
+    std::lock_guard<std::mutex> Lock(Logger.Mutex);
+    while (Tail < Head) {
+        uint32_t Header[2];
+        ring_copy_out(Ring, Tail, Header, sizeof(Header));
+        ring_copy_out(Ring, Tail + sizeof(Header), Text, Header[0]);
+        Tail += sizeof(Header) + Header[0];
+
+        uint32_t Target = Header[1] & ~LOG_CLOSE_TARGET;
+        FILE* File = Target < Logger.Targets.size() ? Logger.Targets[Target] : 0;
+        if (!File) {
+            continue;
         }
-        Str++;
+        if (Header[1] & LOG_CLOSE_TARGET) {
+            fclose(File);
+            Logger.Targets[Target] = 0;
+            continue;
+        }
+        fwrite(Text, 1, Header[0], File);
+        if (Dirty->size() <= Target) {
+            Dirty->resize(Target + 1);
+        }
+        (*Dirty)[Target] = true;
     }
-    return std::string(Start);
+    Ring->Tail.store(Tail, std::memory_order_release);
+    return true;
 }
 
-static std::string trim(const std::string &String) {
-    const char* Str = String.c_str();
-    while (Str[0] && isspace(Str[0])) {
-        Str++;
+static void drain_all_log_rings() {
+    std::vector<bool> Dirty;
+    std::vector<log_ring_t*> Rings;
+    {
+        std::lock_guard<std::mutex> Lock(Logger.Mutex);
+        Rings = Logger.Rings;
     }
-    const char* Ptr = Str;
-    while (*Ptr++);
-    while (Ptr > Str && !isspace(Ptr[0])) {
-        Ptr--;
+    for (size_t i = 0; i < Rings.size(); i++) {
+        drain_log_ring(Rings[i], &Dirty);
     }
-    return std::string(Str, Ptr - Str);
-}
 
-static void draw_indicator(uchar *Pixels, int Width, int Height, int x, int y) {
-    const uchar R = 0x00;
-    const uchar G = 0xFF;
-    const uchar B = 0x00;
-    const int size = 32;
-    int min_x = clamp(x - size / 2, 0, Width - 1);
-    int max_x = clamp(x + size / 2, 0, Width - 1);
-    int min_y = clamp(y - size / 2, 0, Height - 1);
-    int max_y = clamp(y + size / 2, 0, Height - 1);
-    for (int i = min_x; i < max_x; i++) {
-        Pixels[3 * (Width * y + i) + 0] = B;
-        Pixels[3 * (Width * y + i) + 1] = G;
-        Pixels[3 * (Width * y + i) + 2] = R;
+    std::lock_guard<std::mutex> Lock(Logger.Mutex);
+    for (size_t Target = 0; Target < Dirty.size(); Target++) {
+        if (Dirty[Target] && Logger.Targets[Target]) {
+            fflush(Logger.Targets[Target]);
+        }
     }
-    for (int i = min_y; i < max_y; i++) {
-        Pixels[3 * (Width * i + x) + 0] = B;
-        Pixels[3 * (Width * i + x) + 1] = G;
-        Pixels[3 * (Width * i + x) + 2] = R;
+    // NOTE: Rings of exited threads are freed once drained, drain_log_ring already ran after Retired was set
+    for (size_t i = 0; i < Logger.Rings.size();) {
+        log_ring_t* Ring = Logger.Rings[i];
+        if (Ring->Retired.load(std::memory_order_acquire) && Ring->Tail.load() == Ring->Head.load()) {
+            Logger.Rings[i] = Logger.Rings.back();
+            Logger.Rings.pop_back();
+            delete Ring;
+        }
+        else {
+            i++;
+        }
     }
 }
 
-static image_t image_from_cvmat(cv::Mat* M) {
-    image_t Result;
-    Result.Width = M->cols;
-    Result.Height = M->rows;
-    Result.Pixels = M->ptr(0, 0);
-    Result.Channels = 3;
-    Result.Pitch = Result.Channels * Result.Width;
-    return Result;
-}
-
-static image_t subimage(const image_t* Src, const rect_t* SubRect) {
-    image_t Result = *Src;
-    if (SubRect) {
-        Result.Pixels = Src->Pixels + Src->Channels * (SubRect->Y * Src->Width + SubRect->X);
-        Result.Width = SubRect->Width;
-        Result.Height = SubRect->Height;
+static void log_flusher() {
+    for (;;) {
+        bool Stop;
+        {
+            std::unique_lock<std::mutex> Lock(Logger.Mutex);
+            Logger.Wake.wait_for(Lock, std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+            Stop = Logger.Stop;
+        }
+        drain_all_log_rings();
+        if (Stop) {
+            return;
+        }
     }
-
-    return Result;
 }
 
-static void invert_image(image_t* Im) {
-    for (int y = 0; y < Im->Height; y++) {
-        uchar* Row = Im->Pixels + y * Im->Pitch;
-        for (int x = 0; x < Im->Width; x++) {
-            for (int Channel = 0; Channel < Im->Channels; Channel++) {
-                uchar* Pixel = Row + Im->Channels * x + Channel;
-                *Pixel = 255 - *Pixel;
-            }
+static void shutdown_logger() {
+    {
+        std::lock_guard<std::mutex> Lock(Logger.Mutex);
+        if (!Logger.Started) {
+            return;
         }
+        Logger.Stop = true;
+        Logger.Wake.notify_one();
     }
-}
-
-static void to_grayscale(image_t* Im) {
-    for (int y = 0; y < Im->Height; y++) {
-        uchar* Row = Im->Pixels + y * Im->Pitch;
-        for (int x = 0; x < Im->Width; x++) {
-            uchar* Pixel = Row + Im->Channels * x;
-            uchar Value = clamp((int)(0.299f * Pixel[2] + 0.587f * Pixel[1] + 0.114f * Pixel[0]), 0, 255);
-            Pixel[0] = Pixel[1] = Pixel[2] = Value;
+    Logger.Flusher.join();
+    drain_all_log_rings();
+    for (size_t i = 0; i < Logger.Targets.size(); i++) {
+        if (Logger.Targets[i]) {
+            fclose(Logger.Targets[i]);
+            Logger.Targets[i] = 0;
         }
     }
 }
 
-static void change_contrast(image_t* Im, float Contrast) {
-    for (int y = 0; y < Im->Height; y++) {
-        uchar* Row = Im->Pixels + y * Im->Pitch;
-        for (int x = 0; x < Im->Width; x++) {
-            for (int Channel = 0; Channel < Im->Channels; Channel++) {
-                uchar* Pixel = Row + Im->Channels * x + Channel;
-                float Value = Contrast * (Pixel[0] / 255.f - 1.f) + 1.f;
-                *Pixel = clamp((int)((Value + 0.5f) * 255.f), 0x00, 0xff);
-            }
-        }
-    }
+// NOTE: Must be called with Logger.Mutex held
+static uint32_t add_log_target(FILE* File) {
+    Logger.Targets.push_back(File);
+    return (uint32_t)Logger.Targets.size() - 1;
 }
 
-static bool screen_test(cv::Mat* Frame, cv::Size TargetSize, const test_pixel_t *TestPixels, int TestPixelCount, float ThresholdConfidence) {
-    uchar* Pixels = Frame->ptr(0, 0);
-    float Indicator = 0;
-    for (int i = 0; i < TestPixelCount; i++) {
-        const test_pixel_t* TestPixel = TestPixels + i;
-        uchar* Pixel = Pixels + 3 * (TargetSize.width * TestPixel->y + TestPixel->x);
-        uchar B = Pixel[0];
-        uchar G = Pixel[1];
-        uchar R = Pixel[2];
+static log_ring_t* register_log_ring() {
+    log_ring_t* Ring = new log_ring_t;
+    Ring->Head = 0;
+    Ring->Tail = 0;
+    Ring->Retired = false;
+    Ring->DefaultTarget = 0;
 
-        float RDelta = 2.f * (0xff + R - TestPixel->Color[0]) / 510.f - 1.f;
-        float GDelta = 2.f * (0xff + G - TestPixel->Color[1]) / 510.f - 1.f;
-        float BDelta = 2.f * (0xff + B - TestPixel->Color[2]) / 510.f - 1.f;
-        Indicator += sqrtf(square(RDelta) + square(GDelta) + square(BDelta)) / (3.f * TestPixelCount);
+    std::lock_guard<std::mutex> Lock(Logger.Mutex);
+    if (!Logger.Started) {
+        Logger.Started = true;
+        Logger.Stop = false;
+        add_log_target(fopen("Log.txt", "w"));
+        Logger.Flusher = std::thread(log_flusher);
+        atexit(shutdown_logger);
     }
+    if (LogFiles == LOG_FILES_THREAD && !Logger.Rings.empty()) {
+        char Path[64];
+        snprintf(Path, sizeof(Path), "Log.%d.txt", (int)Logger.Targets.size());
+        Ring->DefaultTarget = add_log_target(fopen(Path, "w"));
+    }
+    Logger.Rings.push_back(Ring);
+    return Ring;
+}
 
-    bool Result = (1.f - Indicator) >= ThresholdConfidence;
-#if WITH_VIDEO
-    if (Result) {
-        for (int i = 0; i < TestPixelCount; i++) {
-            const test_pixel_t* TestPixel = TestPixels + i;
-            for (int y = -1; y <= 1; y++) {
-                for (int x = -1; x <= 1; x++) {
-                    draw_indicator(Pixels, TargetSize.width, TargetSize.height, TestPixel->x + x, TestPixel->y + y);
-                }
-            }
+// NOTE: Trivially destructible, so that it stays usable while the other thread locals of an exiting thread are
+// destroyed. Retired is set once the ring has been handed to the flusher, which frees it.
+struct thread_log_t {
+    log_ring_t* Ring;
+    uint32_t Target;
+    bool Retired;
+};
+
+static thread_local thread_log_t ThreadLog = { 0, 0, false };
+
+struct thread_log_retirer_t {
+    ~thread_log_retirer_t() {
+        if (ThreadLog.Ring) {
+            ThreadLog.Ring->Retired.store(true, std::memory_order_release);
+            ThreadLog.Ring = 0;
         }
+        ThreadLog.Retired = true;
     }
-#endif
-
-    return Result;
-}
+};
 
-static void scan_stigmata_screen(state_t* State, cv::Mat* RefFrame) {
-    add_event(State, EVENT_STIGMATA_SCREEN);
+static thread_local thread_log_retirer_t ThreadLogRetirer;
 
-    static int StigmataFrameIndex = 0;
-    log_timestamp(State->Capture, "Stigmata screen");
+// NOTE: Returns 0 once the thread has retired its ring
+static log_ring_t* get_thread_log_ring() {
+    if (!ThreadLog.Ring && !ThreadLog.Retired) {
+        ThreadLog.Ring = register_log_ring();
+        ThreadLog.Target = ThreadLog.Ring->DefaultTarget;
+        // NOTE: The first use registers its destructor for this thread
+        (void)&ThreadLogRetirer;
+    }
+    return ThreadLog.Ring;
+}
 
-    image_t Image = image_from_cvmat(RefFrame);
+// NOTE: Records logged during thread exit, after the ring was retired, go straight to the shared log
+static void write_shared_log_record(uint32_t Target, const char* Text, uint32_t Length) {
+    std::lock_guard<std::mutex> Lock(Logger.Mutex);
+    if ((Target & LOG_CLOSE_TARGET) || Logger.Targets.empty() || !Logger.Targets[0]) {
+        return;
+    }
+    fwrite(Text, 1, Length, Logger.Targets[0]);
+    fflush(Logger.Targets[0]);
+}
 
-    const int NameBoxWidth = 484;
-    const int NameBoxHeight = 72;
-    rect_t NameBox = {
-        188, 912, NameBoxWidth, NameBoxHeight
-    };
-    {
-        rect_t* Box = &NameBox;
-        image_t SubImage = subimage(&Image, Box);
-        change_contrast(&SubImage, 4.f);
-        invert_image(&SubImage);
-        to_grayscale(&SubImage);
-        State->Tess.SetImage(SubImage.Pixels, Box->Width, Box->Height, SubImage.Channels, SubImage.Pitch);
-        State->Tess.Recognize(0);
-        char* Str = State->Tess.GetUTF8Text();
-        std::string Text = trim(replace_char(Str, '\n', ' '));
-        delete[] Str;
-        LOGMSG("Valkyrie: %s\n", Text.c_str());
-        add_event(State, EVENT_VALKYRIE_NAME, Text);
-        State->Tess.Clear();
-    }
-
-    const int StigmataBoxWidth = 284;
-    const int StigmataBoxHeight = 188;
-    char BoxNames[3] = { 'T', 'M', 'B' };
-    rect_t StigmataBoxes[3] = {
-        { 872, 550, StigmataBoxWidth, StigmataBoxHeight},
-        {1232, 550, StigmataBoxWidth, StigmataBoxHeight},
-        {1592, 550, StigmataBoxWidth, StigmataBoxHeight},
-    };
-    for (int i = 0; i < 3; i++) {
-        rect_t* Box = StigmataBoxes + i;
-        image_t SubImage = subimage(&Image, Box);
-        invert_image(&SubImage);
-        change_contrast(&SubImage, 4.f);
-        State->Tess.SetImage(SubImage.Pixels, Box->Width, Box->Height, SubImage.Channels, SubImage.Pitch);
-        State->Tess.Recognize(0);
-        char* Str = State->Tess.GetUTF8Text();
-        std::string Text = trim(replace_char(Str, '\n', ' '));
-        delete[] Str;
-        LOGMSG("Stigmata (%c): %s\n", BoxNames[i], Text.c_str());
-        add_event(State, EVENT_STIGMATA, Text);
-        State->Tess.Clear();
+static void push_log_record(uint32_t Target, const char* Text, uint32_t Length) {
+    log_ring_t* Ring = get_thread_log_ring();
+    if (!Ring) {
+        write_shared_log_record(Target, Text, Length);
+        return;
+    }
+    uint32_t Header[2] = { Length, Target };
+    uint64_t Size = sizeof(Header) + Length;
+    uint64_t Head = Ring->Head.load(std::memory_order_relaxed);
+    while (Head + Size - Ring->Tail.load(std::memory_order_acquire) > LOG_RING_BYTES) {
+        Logger.Wake.notify_one();
+        std::this_thread::yield();
     }
+    ring_copy_in(Ring, Head, Header, sizeof(Header));
+    ring_copy_in(Ring, Head + sizeof(Header), Text, Length);
+    Ring->Head.store(Head + Size, std::memory_order_release);
 
-    char Buffer[256];
-    snprintf(Buffer, sizeof(Buffer), "%s/stigmata_frame_%d.png", "./Output", StigmataFrameIndex++);
-    cv::imwrite(Buffer, *RefFrame);
+    if (Head + Size - Ring->Tail.load(std::memory_order_relaxed) > LOG_RING_BYTES / 2) {
+        Logger.Wake.notify_one();
+    }
 }
 
-static void scan_lineup_screen(state_t* State, cv::Mat* RefFrame) {
-    add_event(State, EVENT_LINEUP_SCREEN);
+static void log_message(int Level, const char* fmt, ...) {
+    char Text[LOG_RECORD_MAX_BYTES];
+    int Prefix = 0;
+    if (Level == LOG_LEVEL_WARN) {
+        Prefix = snprintf(Text, sizeof(Text), "Warning: ");
+    }
+    else if (Level == LOG_LEVEL_ERROR) {
+        Prefix = snprintf(Text, sizeof(Text), "Error: ");
+    }
 
-    static int LineupFrameIndex = 0;
-    log_timestamp(State->Capture, "Lineup screen");
+    va_list args;
+    va_start(args, fmt);
+    int Length = vsnprintf(Text + Prefix, sizeof(Text) - Prefix, fmt, args);
+    va_end(args);
+    if (Length < 0) {
+        return;
+    }
+    Length = std::min(Prefix + Length, (int)sizeof(Text) - 1);
 
-    uchar* Image = RefFrame->ptr(0, 0);
-    const int ImageChannels = 3;
-    const int ImageStrideBytes = ImageChannels * State->Width;
+    get_thread_log_ring();
+    push_log_record(ThreadLog.Target, Text, (uint32_t)Length);
+}
+
+#define LOG(Level, ...) do { if ((Level) >= LOG_COMPILED_LEVEL && (Level) >= LogLevel) log_message((Level), __VA_ARGS__); } while (0)
+#define LOGDEBUG(...) LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOGMSG(...) LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOGWARN(...) LOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOGERROR(...) LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// NOTE: Everything the calling thread logs until end_job_log goes to Path instead of the shared log
+static void begin_job_log(const std::string& Path) {
+    if (LogFiles != LOG_FILES_JOB) {
+        return;
+    }
+    get_thread_log_ring();
+    FILE* File = fopen(Path.c_str(), "w");
+    if (!File) {
+        return;
+    }
+    std::lock_guard<std::mutex> Lock(Logger.Mutex);
+    ThreadLog.Target = add_log_target(File);
+}
+
+static void end_job_log() {
+    if (!ThreadLog.Ring || ThreadLog.Target == ThreadLog.Ring->DefaultTarget) {
+        return;
+    }
+    push_log_record(ThreadLog.Target | LOG_CLOSE_TARGET, "", 0);
+    ThreadLog.Target = ThreadLog.Ring->DefaultTarget;
+}
+
+enum stats_stage_t {
+    STAGE_DECODE,
+    STAGE_RESIZE,
+    STAGE_SCREEN_TEST,
+    STAGE_PREPROCESS,
+    STAGE_OCR,
+    STAGE_DIGITS,
+    STAGE_IMWRITE,
+    STAGE_OUTPUT,
+
+    STAGE_COUNT
+};
+
+enum stats_counter_t {
+    COUNTER_FRAMES_DECODED,
+    COUNTER_FRAMES_TESTED,
+    COUNTER_SCREENS_DETECTED,
+    COUNTER_OCR_CALLS,
+    COUNTER_BYTES_WRITTEN,
+    COUNTER_DIGIT_FALLBACKS,
+    COUNTER_KEYFRAMES_TESTED,
+    COUNTER_FRAMES_SKIPPED,
+
+    COUNTER_COUNT
+};
+
+// NOTE: Only the owning thread writes its block, so updates are plain relaxed load/store pairs without
+// any locked instruction. The report sums all blocks, blocks of exited threads are kept for that.
+struct thread_stats_t {
+    std::atomic<uint64_t> StageNs[STAGE_COUNT];
+    std::atomic<uint64_t> StageCalls[STAGE_COUNT];
+    std::atomic<uint64_t> Counters[COUNTER_COUNT];
+    std::atomic<uint64_t> OcrLatency[STATS_LATENCY_BUCKETS];
+};
+
+struct stats_t {
+    std::mutex Mutex;
+    std::vector<thread_stats_t*> Threads;
+    std::chrono::steady_clock::time_point Start;
+};
+
+static stats_t Stats;
+// NOTE: Polled by every scanning thread and the daemon and batch loops, only the one that clears it reports
+static std::atomic<int> StatsRequested(0);
+static thread_local thread_stats_t* ThreadStats = 0;
+
+static thread_stats_t* get_thread_stats() {
+    if (!ThreadStats) {
+        thread_stats_t* Block = new thread_stats_t;
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            Block->StageNs[i] = 0;
+            Block->StageCalls[i] = 0;
+        }
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            Block->Counters[i] = 0;
+        }
+        for (int i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+            Block->OcrLatency[i] = 0;
+        }
+        std::lock_guard<std::mutex> Lock(Stats.Mutex);
+        Stats.Threads.push_back(Block);
+        ThreadStats = Block;
+    }
+    return ThreadStats;
+}
+
+static inline void stats_add(std::atomic<uint64_t>* Value, uint64_t Amount) {
+    Value->store(Value->load(std::memory_order_relaxed) + Amount, std::memory_order_relaxed);
+}
+
+static inline uint64_t stats_now_ns() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int latency_bucket(uint64_t Us) {
+    if (Us < STATS_LATENCY_SUB_BUCKETS) {
+        return (int)Us;
+    }
+    int Exponent = 3;
+    while (Us >> (Exponent + 1)) {
+        Exponent++;
+    }
+    int Bucket = (Exponent - 2) * STATS_LATENCY_SUB_BUCKETS + (int)((Us >> (Exponent - 3)) & (STATS_LATENCY_SUB_BUCKETS - 1));
+    return std::min(Bucket, STATS_LATENCY_BUCKETS - 1);
+}
+
+static uint64_t latency_bucket_floor(int Bucket) {
+    if (Bucket < STATS_LATENCY_SUB_BUCKETS) {
+        return (uint64_t)Bucket;
+    }
+    int Exponent = Bucket / STATS_LATENCY_SUB_BUCKETS + 2;
+    return (uint64_t)(STATS_LATENCY_SUB_BUCKETS + Bucket % STATS_LATENCY_SUB_BUCKETS) << (Exponent - 3);
+}
+
+static inline void count_stat(int Counter, uint64_t Amount = 1) {
+#if WITH_STATS
+    stats_add(&get_thread_stats()->Counters[Counter], Amount);
+#else
+    (void)Counter;
+    (void)Amount;
+#endif
+}
+
+static const char* stage_name(int Stage) {
+    static const char* Names[STAGE_COUNT] = { "decode", "resize", "screen_test", "preprocess", "ocr", "digits", "imwrite", "output" };
+    return Names[Stage];
+}
+
+struct trace_span_t {
+    const char* Name;
+    const char* Screen;
+    uint64_t BeginNs;
+    // NOTE: UINT64_MAX marks a counter sample, Frame then holds the value
+    uint64_t DurationNs;
+    uint32_t Thread;
+    int32_t Frame;
+};
+
+struct trace_t {
+    trace_span_t* Spans;
+    // NOTE: Counts every span ever recorded, 64 bits never wrap. The slot of a span is Count % TRACE_MAX_SPANS.
+    std::atomic<uint64_t> Count;
+    // NOTE: write_trace closes the buffer at exit while pool workers may still record, it waits for the spans
+    // being written to finish and later ones are dropped. Writers and Closed are sequentially consistent, so a
+    // recording thread either sees Closed or is counted before write_trace reads the spans.
+    std::atomic<bool> Closed;
+    std::atomic<uint32_t> Writers;
+    std::string Path;
+    uint64_t StartNs;
+};
+
+static trace_t Trace;
+static std::atomic<uint32_t> TraceThreadCount(0);
+static thread_local uint32_t TraceThread = 0;
+static thread_local int32_t TraceFrame = -1;
+static thread_local const char* TraceScreen = 0;
+
+static void trace_record(const char* Name, uint64_t BeginNs, uint64_t DurationNs, int32_t Frame) {
+    Trace.Writers.fetch_add(1, std::memory_order_seq_cst);
+    if (Trace.Closed.load(std::memory_order_seq_cst)) {
+        Trace.Writers.fetch_sub(1, std::memory_order_relaxed);
+        return;
+    }
+    uint64_t Index = Trace.Count.fetch_add(1, std::memory_order_relaxed);
+    if (!TraceThread) {
+        TraceThread = ++TraceThreadCount;
+    }
+    trace_span_t* Span = Trace.Spans + Index % TRACE_MAX_SPANS;
+    Span->Name = Name;
+    Span->Screen = TraceScreen;
+    Span->BeginNs = BeginNs;
+    Span->DurationNs = DurationNs;
+    Span->Thread = TraceThread;
+    Span->Frame = Frame;
+    Trace.Writers.fetch_sub(1, std::memory_order_release);
+}
+
+static inline void trace_counter(const char* Name, int32_t Value) {
+    if (Trace.Spans) {
+        trace_record(Name, stats_now_ns(), UINT64_MAX, Value);
+    }
+}
+
+struct trace_scope_t {
+    const char* Name;
+    uint64_t BeginNs;
+
+    trace_scope_t(const char* Name) : Name(Name), BeginNs(Trace.Spans ? stats_now_ns() : 0) {}
+    ~trace_scope_t() {
+        if (Trace.Spans) {
+            trace_record(Name, BeginNs, stats_now_ns() - BeginNs, TraceFrame);
+        }
+    }
+};
+
+static void record_stage(int Stage, uint64_t BeginNs) {
+    thread_stats_t* Block = get_thread_stats();
+    uint64_t Ns = stats_now_ns() - BeginNs;
+    stats_add(&Block->StageNs[Stage], Ns);
+    stats_add(&Block->StageCalls[Stage], 1);
+    if (Stage == STAGE_OCR) {
+        stats_add(&Block->OcrLatency[latency_bucket(Ns / 1000)], 1);
+    }
+    if (Trace.Spans) {
+        trace_record(stage_name(Stage), BeginNs, Ns, TraceFrame);
+    }
+}
+
+struct stage_timer_t {
+    int Stage;
+    uint64_t BeginNs;
+
+    stage_timer_t(int Stage) : Stage(Stage), BeginNs(stats_now_ns()) {}
+    ~stage_timer_t() { record_stage(Stage, BeginNs); }
+};
+
+#if WITH_STATS
+#define STATS_CONCAT_(a, b) a##b
+#define STATS_CONCAT(a, b) STATS_CONCAT_(a, b)
+#define TIME_STAGE(Stage) stage_timer_t STATS_CONCAT(StageTimer, __LINE__)(Stage)
+#define TRACE_SCOPE(Name) trace_scope_t STATS_CONCAT(TraceScope, __LINE__)(Name)
+#else
+#define TIME_STAGE(Stage)
+#define TRACE_SCOPE(Name)
+#endif
+
+static const char* counter_name(int Counter) {
+    static const char* Names[COUNTER_COUNT] = { "frames decoded", "frames tested", "screens detected", "ocr calls", "bytes written", "digit fallbacks", "keyframes tested", "frames skipped" };
+    return Names[Counter];
+}
+
+// NOTE: Reads the blocks while other threads keep updating them, the report is a consistent enough snapshot
+static void report_stats() {
+    uint64_t StageNs[STAGE_COUNT] = {};
+    uint64_t StageCalls[STAGE_COUNT] = {};
+    uint64_t Counters[COUNTER_COUNT] = {};
+    uint64_t OcrLatency[STATS_LATENCY_BUCKETS] = {};
+    {
+        std::lock_guard<std::mutex> Lock(Stats.Mutex);
+        for (size_t t = 0; t < Stats.Threads.size(); t++) {
+            thread_stats_t* Block = Stats.Threads[t];
+            for (int i = 0; i < STAGE_COUNT; i++) {
+                StageNs[i] += Block->StageNs[i].load(std::memory_order_relaxed);
+                StageCalls[i] += Block->StageCalls[i].load(std::memory_order_relaxed);
+            }
+            for (int i = 0; i < COUNTER_COUNT; i++) {
+                Counters[i] += Block->Counters[i].load(std::memory_order_relaxed);
+            }
+            for (int i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+                OcrLatency[i] += Block->OcrLatency[i].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    double Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Stats.Start).count();
+    fprintf(stderr, "%-12s %7s %14s %9s\n", "stage", "calls", "total ms", "avg us");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        double Ms = StageNs[i] / 1e6;
+        fprintf(stderr, "%-12s %7llu %14.1f %9.1f\n", stage_name(i), (unsigned long long)StageCalls[i], Ms,
+                StageCalls[i] ? 1e3 * Ms / StageCalls[i] : 0.0);
+    }
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        fprintf(stderr, "%-18s %llu\n", counter_name(i), (unsigned long long)Counters[i]);
+    }
+
+    // NOTE: Percentiles are reported as the lower bound of the bucket they fall into, at most 12.5% off
+    uint64_t OcrCalls = StageCalls[STAGE_OCR];
+    if (OcrCalls) {
+        const double Percentiles[] = { 0.5, 0.9, 0.99, 1.0 };
+        const char* Labels[] = { "p50", "p90", "p99", "max" };
+        fprintf(stderr, "ocr latency  ");
+        for (int p = 0; p < (int)ARRAY_COUNT(Percentiles); p++) {
+            uint64_t Rank = (uint64_t)std::ceil(Percentiles[p] * OcrCalls);
+            uint64_t Seen = 0;
+            int Bucket = 0;
+            for (; Bucket < STATS_LATENCY_BUCKETS - 1; Bucket++) {
+                Seen += OcrLatency[Bucket];
+                if (Seen >= Rank) {
+                    break;
+                }
+            }
+            fprintf(stderr, " %s %.1fms", Labels[p], latency_bucket_floor(Bucket) / 1e3);
+        }
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "%.1fs elapsed, %.1f fps\n", Seconds, Seconds > 0 ? Counters[COUNTER_FRAMES_DECODED] / Seconds : 0.0);
+    fflush(stderr);
+}
+
+static void request_stats(int) {
+    StatsRequested = 1;
+}
+
+// NOTE: The signal handler only sets a flag, the report is printed by the next scanned frame or, when nothing is
+// being scanned, by the daemon or batch loop within STATS_POLL_INTERVAL_MS
+static void poll_stats_request() {
+#if WITH_STATS
+    if (StatsRequested.exchange(0)) {
+        report_stats();
+    }
+#endif
+}
+
+// NOTE: Chrome trace event format, loads in chrome://tracing and ui.perfetto.dev
+static void write_trace() {
+    Trace.Closed.store(true, std::memory_order_seq_cst);
+    while (Trace.Writers.load(std::memory_order_seq_cst) != 0) {
+        std::this_thread::yield();
+    }
+    FILE* File = fopen(Trace.Path.c_str(), "w");
+    if (!File) {
+        fprintf(stderr, "Could not write trace %s\n", Trace.Path.c_str());
+        return;
+    }
+    uint64_t Count = Trace.Count.load();
+    uint64_t First = 0;
+    if (Count > TRACE_MAX_SPANS) {
+        First = Count - TRACE_MAX_SPANS;
+        fprintf(stderr, "Trace buffer full, dropped the oldest %llu spans\n", (unsigned long long)First);
+    }
+
+    fprintf(File, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    const char* Separator = "\n";
+    for (uint64_t i = First; i < Count; i++) {
+        const trace_span_t* Span = Trace.Spans + i % TRACE_MAX_SPANS;
+        if (!Span->Name) {
+            continue;
+        }
+        fprintf(File, "%s", Separator);
+        Separator = ",\n";
+        double Ts = (Span->BeginNs - Trace.StartNs) / 1e3;
+        if (Span->DurationNs == UINT64_MAX) {
+            fprintf(File, "{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"value\":%d}}",
+                    Span->Name, Ts, Span->Thread, Span->Frame);
+        }
+        else {
+            fprintf(File, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{",
+                    Span->Name, Ts, Span->DurationNs / 1e3, Span->Thread);
+            if (Span->Frame >= 0) {
+                fprintf(File, "\"frame\":%d%s", Span->Frame, Span->Screen ? "," : "");
+            }
+            if (Span->Screen) {
+                fprintf(File, "\"screen\":\"%s\"", Span->Screen);
+            }
+            fprintf(File, "}}");
+        }
+    }
+    fprintf(File, "\n]}\n");
+    fclose(File);
+}
+
+// NOTE: Must be called before any other thread is started, the span buffer is allocated up front
+static void init_trace(const std::string& Path) {
+#if WITH_STATS
+    Trace.Spans = new trace_span_t[TRACE_MAX_SPANS]();
+    Trace.Path = Path;
+    Trace.StartNs = stats_now_ns();
+    atexit(write_trace);
+#else
+    (void)Path;
+#endif
+}
+
+static void init_stats() {
+#if WITH_STATS
+    Stats.Start = std::chrono::steady_clock::now();
+    atexit(report_stats);
+#if _WIN32
+    signal(SIGBREAK, request_stats);
+#else
+    signal(SIGUSR1, request_stats);
+#endif
+#endif
+}
+
+static void OUTPUT(const char* fmt, ...) {
+    static FILE* Out = stdout;
+    static std::mutex Mutex;
+    if (Out) {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        va_list args;
+        va_start(args, fmt);
+        vfprintf(Out, fmt, args);
+        fputc('\n', Out);
+        va_end(args);
+    }
+}
+
+// NOTE: Uses the frame metadata the scan loop already keeps in the state instead of querying the capture
+static void log_timestamp(const state_t* State, const char* Msg) {
+    int timer = (int)State->FrameMs;
+    int milliseconds = timer % 1000; timer /= 1000;
+    int seconds = timer % 60; timer /= 60;
+    int minutes = timer % 60; timer /= 60;
+    int hours = timer;
+    LOGMSG("Frame number %d (%d:%02d:%02d:%03d): %s\n", State->FrameIndex, hours, minutes, seconds, milliseconds, Msg);
+}
+
+static bool map_file(mapped_file_t* File, const char* Path) {
+    File->Data = 0;
+    File->Size = 0;
+#if _WIN32
+    HANDLE Handle = CreateFileA(Path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (Handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER FileSize;
+    HANDLE Mapping = 0;
+    if (GetFileSizeEx(Handle, &FileSize) && FileSize.QuadPart > 0) {
+        Mapping = CreateFileMappingA(Handle, 0, PAGE_READONLY, 0, 0, 0);
+    }
+    CloseHandle(Handle);
+    if (!Mapping) {
+        return false;
+    }
+    // NOTE: The view keeps the mapping alive
+    File->Data = (const char*)MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(Mapping);
+    if (!File->Data) {
+        return false;
+    }
+    File->Size = (size_t)FileSize.QuadPart;
+#else
+    int Fd = open(Path, O_RDONLY);
+    if (Fd < 0) {
+        return false;
+    }
+    struct stat Stat;
+    void* Data = MAP_FAILED;
+    if (fstat(Fd, &Stat) == 0 && Stat.st_size > 0) {
+        Data = mmap(0, (size_t)Stat.st_size, PROT_READ, MAP_PRIVATE, Fd, 0);
+    }
+    close(Fd);
+    if (Data == MAP_FAILED) {
+        return false;
+    }
+    File->Data = (const char*)Data;
+    File->Size = (size_t)Stat.st_size;
+#endif
+    return true;
+}
+
+// NOTE: The traineddata is mapped once per process and stays mapped, every engine initializes from the same view
+static const mapped_file_t* get_traineddata() {
+    static std::mutex Mutex;
+    static bool Attempted = false;
+    static mapped_file_t File;
+
+    std::lock_guard<std::mutex> Lock(Mutex);
+    if (!Attempted) {
+        Attempted = true;
+        char Path[256];
+        snprintf(Path, sizeof(Path), "%s/%s.traineddata", OCR_DATA_PATH, OCR_LANGUAGE);
+        if (map_file(&File, Path)) {
+            LOGMSG("Mapped %s (%zu bytes)\n", Path, File.Size);
+        }
+        else {
+            LOGWARN("Could not map %s, falling back to tesseract file loading\n", Path);
+        }
+    }
+
+    return File.Data ? &File : 0;
+}
+
+static bool init_ocr_engine(ocr_engine_t* Engine) {
+    int64_t StartTicks = cv::getTickCount();
+    const mapped_file_t* Traineddata = get_traineddata();
+    int Error;
+    if (Traineddata) {
+        Error = Engine->Tess.Init(Traineddata->Data, (int)Traineddata->Size, OCR_LANGUAGE, tesseract::OEM_DEFAULT, 0, 0, 0, 0, false, 0);
+    }
+    else {
+        Error = Engine->Tess.Init(OCR_DATA_PATH, OCR_LANGUAGE);
+    }
+    if (Error) {
+        LOGERROR("Could not initialize tesseract\n");
+        return false;
+    }
+
+    Engine->Tess.SetPageSegMode(tesseract::PageSegMode::PSM_SINGLE_BLOCK);
+    Engine->Tess.SetVariable("save_best_choices", "T");
+    Engine->Tess.SetVariable("user_defined_dpi", "300");
+
+    double Ms = 1000.0 * (cv::getTickCount() - StartTicks) / cv::getTickFrequency();
+    LOGMSG("Initialized tesseract %s %s in %.1fms\n", Engine->Tess.Version(), Engine->Tess.GetInitLanguagesAsString(), Ms);
+    return true;
+}
+
+static void warm_ocr_engine(ocr_engine_t* Engine) {
+    if (!Engine->Initialized && !Engine->Failed && !Engine->Warmup.valid()) {
+        Engine->Warmup = std::async(std::launch::async, init_ocr_engine, Engine);
+    }
+}
+
+// NOTE: Returns 0 if tesseract could not be initialized, the failure is only reported once
+static tesseract::TessBaseAPI* acquire_tess(ocr_engine_t* Engine) {
+    if (!Engine->Initialized && !Engine->Failed) {
+        bool Ok = Engine->Warmup.valid() ? Engine->Warmup.get() : init_ocr_engine(Engine);
+        Engine->Initialized = Ok;
+        Engine->Failed = !Ok;
+    }
+
+    return Engine->Initialized ? &Engine->Tess : 0;
+}
+
+static void init_ocr_engine_slot(ocr_engine_t* Engine) {
+    Engine->Initialized = false;
+    Engine->Failed = false;
+}
+
+typedef std::function<void(int WorkerIndex)> work_task_t;
+
+struct work_queue_t {
+    std::mutex Mutex;
+    std::deque<work_task_t> Tasks;
+};
+
+// NOTE: Every worker pushes and pops at the back of its own queue and steals from the front of the others.
+// Tasks submitted from outside the pool are distributed round robin.
+struct work_pool_t {
+    int WorkerCount;
+    work_queue_t* Queues;
+    std::vector<std::thread> Workers;
+    std::mutex IdleMutex;
+    std::condition_variable WorkAvailable;
+    std::condition_variable AllDone;
+    std::atomic<int> QueuedTasks;
+    std::atomic<int> PendingTasks;
+    std::atomic<int> NextQueue;
+    bool Stop;
+};
+
+static void submit_work(work_pool_t* Pool, int WorkerIndex, work_task_t Task) {
+    int QueueIndex = WorkerIndex >= 0 ? WorkerIndex : (int)(Pool->NextQueue++ % Pool->WorkerCount);
+    Pool->PendingTasks++;
+    {
+        work_queue_t* Queue = Pool->Queues + QueueIndex;
+        std::lock_guard<std::mutex> Lock(Queue->Mutex);
+        Queue->Tasks.push_back(std::move(Task));
+    }
+    trace_counter("queued tasks", ++Pool->QueuedTasks);
+
+    std::lock_guard<std::mutex> Lock(Pool->IdleMutex);
+    Pool->WorkAvailable.notify_one();
+}
+
+static bool take_work(work_pool_t* Pool, int WorkerIndex, work_task_t* Task) {
+    for (int i = 0; i < Pool->WorkerCount; i++) {
+        work_queue_t* Queue = Pool->Queues + (WorkerIndex + i) % Pool->WorkerCount;
+        std::lock_guard<std::mutex> Lock(Queue->Mutex);
+        if (!Queue->Tasks.empty()) {
+            if (i == 0) {
+                *Task = std::move(Queue->Tasks.back());
+                Queue->Tasks.pop_back();
+            }
+            else {
+                *Task = std::move(Queue->Tasks.front());
+                Queue->Tasks.pop_front();
+            }
+            trace_counter("queued tasks", --Pool->QueuedTasks);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void work_pool_worker(work_pool_t* Pool, int WorkerIndex) {
+    for (;;) {
+        work_task_t Task;
+        if (take_work(Pool, WorkerIndex, &Task)) {
+            TRACE_SCOPE("task");
+            Task(WorkerIndex);
+            if (--Pool->PendingTasks == 0) {
+                std::lock_guard<std::mutex> Lock(Pool->IdleMutex);
+                Pool->AllDone.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> Lock(Pool->IdleMutex);
+        Pool->WorkAvailable.wait(Lock, [Pool] { return Pool->Stop || Pool->QueuedTasks > 0; });
+        if (Pool->Stop) {
+            return;
+        }
+    }
+}
+
+static void start_work_pool(work_pool_t* Pool, int WorkerCount) {
+    Pool->WorkerCount = WorkerCount;
+    Pool->Queues = new work_queue_t[WorkerCount];
+    Pool->QueuedTasks = 0;
+    Pool->PendingTasks = 0;
+    Pool->NextQueue = 0;
+    Pool->Stop = false;
+    for (int i = 0; i < WorkerCount; i++) {
+        Pool->Workers.push_back(std::thread(work_pool_worker, Pool, i));
+    }
+}
+
+// NOTE: Returns false if tasks are still pending after Ms
+static bool wait_work_pool_for(work_pool_t* Pool, int Ms) {
+    std::unique_lock<std::mutex> Lock(Pool->IdleMutex);
+    return Pool->AllDone.wait_for(Lock, std::chrono::milliseconds(Ms), [Pool] { return Pool->PendingTasks == 0; });
+}
+
+static void stop_work_pool(work_pool_t* Pool) {
+    {
+        std::lock_guard<std::mutex> Lock(Pool->IdleMutex);
+        Pool->Stop = true;
+        Pool->WorkAvailable.notify_all();
+    }
+    for (size_t i = 0; i < Pool->Workers.size(); i++) {
+        Pool->Workers[i].join();
+    }
+    Pool->Workers.clear();
+    delete[] Pool->Queues;
+}
+
+static ocr_engine_t* create_ocr_engines(int Count, bool Warm) {
+    ocr_engine_t* Engines = new ocr_engine_t[Count];
+    for (int i = 0; i < Count; i++) {
+        init_ocr_engine_slot(Engines + i);
+        if (Warm) {
+            warm_ocr_engine(Engines + i);
+        }
+    }
+    return Engines;
+}
+
+// NOTE: Started on first use, so runs without multi-ROI screens never create the threads or their engines
+struct ocr_pool_t {
+    work_pool_t Pool;
+    ocr_engine_t* Engines;
+    int ThreadCount;
+    std::once_flag Started;
+};
+
+static ocr_pool_t OcrPool = { {}, 0, -1, {} };
+
+static void stop_ocr_pool() {
+    stop_work_pool(&OcrPool.Pool);
+}
+
+static void start_ocr_pool() {
+    OcrPool.Engines = create_ocr_engines(OcrPool.ThreadCount, false);
+    start_work_pool(&OcrPool.Pool, OcrPool.ThreadCount);
+    atexit(stop_ocr_pool);
+}
+
+typedef std::function<void(ocr_engine_t* Engine, int Index)> ocr_task_t;
+
+// NOTE: Runs Task for every index in [0, Count) and returns once all of them are done. The calling thread takes
+// index 0 with its own engine, the others go to the OCR pool.
+// NOTE: An engine that could not be initialized sets State->OcrFailed, the scan stops after the current frame
+static void run_ocr_tasks(state_t* State, int Count, const ocr_task_t& Task) {
+    if (OcrPool.ThreadCount < 1 || Count < 2) {
+        for (int i = 0; i < Count; i++) {
+            Task(State->Ocr, i);
+        }
+        State->OcrFailed = State->OcrFailed || State->Ocr->Failed;
+        return;
+    }
+    std::call_once(OcrPool.Started, start_ocr_pool);
+
+    std::mutex Mutex;
+    std::condition_variable AllDone;
+    int Remaining = Count - 1;
+    bool Failed = false;
+    for (int i = 1; i < Count; i++) {
+        submit_work(&OcrPool.Pool, -1, [&Task, &Mutex, &AllDone, &Remaining, &Failed, i](int WorkerIndex) {
+            ocr_engine_t* Engine = OcrPool.Engines + WorkerIndex;
+            Task(Engine, i);
+            std::lock_guard<std::mutex> Lock(Mutex);
+            Failed = Failed || Engine->Failed;
+            if (--Remaining == 0) {
+                AllDone.notify_one();
+            }
+        });
+    }
+    Task(State->Ocr, 0);
+
+    std::unique_lock<std::mutex> Lock(Mutex);
+    AllDone.wait(Lock, [&Remaining] { return Remaining == 0; });
+    State->OcrFailed = State->OcrFailed || Failed || State->Ocr->Failed;
+}
+
+static void init_string_table(string_table_t* Table) {
+    Table->Chars.clear();
+    Table->Offsets.clear();
+    Table->Ids.clear();
+    Table->Chars.reserve(4096);
+    Table->Offsets.reserve(256);
+    Table->Chars.push_back(0);
+    Table->Offsets.push_back(0);
+}
+
+// NOTE: Only allocates for values that were never seen before, repeated names are a single hash lookup
+static uint32_t intern_string(string_table_t* Table, const std::string& String) {
+    if (String.empty()) {
+        return 0;
+    }
+
+    auto It = Table->Ids.find(String);
+    if (It != Table->Ids.end()) {
+        return It->second;
+    }
+
+    uint32_t Id = (uint32_t)Table->Offsets.size();
+    Table->Offsets.push_back((uint32_t)Table->Chars.size());
+    Table->Chars.insert(Table->Chars.end(), String.begin(), String.end());
+    Table->Chars.push_back(0);
+    Table->Ids.emplace(String, Id);
+    return Id;
+}
+
+static const char* get_string(const string_table_t* Table, uint32_t Id) {
+    return Table->Chars.data() + Table->Offsets[Id];
+}
+
+// NOTE: Drains the buffered events into the sink, FlushSink additionally makes the sink push them out
+static void flush_events(state_t* State, bool FlushSink) {
+    event_buffer_t* Buffer = &State->Events;
+    for (; Buffer->Count > 0; Buffer->Count--) {
+        const event_t* Event = Buffer->Events + Buffer->First;
+        const char* Value = get_string(&State->Strings, Event->ValueId);
+        for (event_sink_t* Sink = State->Sink; Sink; Sink = Sink->Next) {
+            Sink->Write(Sink, Event, Value);
+        }
+        Buffer->First = (Buffer->First + 1) % EVENT_BUFFER_CAPACITY;
+        State->EmittedEvents++;
+    }
+    for (event_sink_t* Sink = State->Sink; FlushSink && Sink; Sink = Sink->Next) {
+        if (Sink->Flush) {
+            Sink->Flush(Sink);
+        }
+    }
+}
+
+// NOTE: Confidence is the OCR confidence in [0, 100], or -1 for events that were not read by OCR
+static void add_event_at(state_t* State, event_type_t Type, const std::string& Value, int Frame, double Ms, int Confidence = -1) {
+    event_buffer_t* Buffer = &State->Events;
+    if (Buffer->Count == EVENT_BUFFER_CAPACITY) {
+        flush_events(State, false);
+    }
+
+    event_t* Event = Buffer->Events + (Buffer->First + Buffer->Count) % EVENT_BUFFER_CAPACITY;
+    Event->Type = Type;
+    Event->ValueId = intern_string(&State->Strings, Value);
+    Event->Frame = Frame;
+    Event->Ms = (int32_t)Ms;
+    Event->Confidence = Confidence;
+    Buffer->Count++;
+
+    if (State->Options->FlushMode == FLUSH_EVENT) {
+        flush_events(State, true);
+    }
+}
+
+void add_event(state_t* State, event_type_t Type, const std::string& Value = std::string()) {
+    add_event_at(State, Type, Value, State->FrameIndex, State->FrameMs);
+}
+
+// NOTE: Called once a screen appearance is finalized and all of its events have been added
+static void end_of_screen(state_t* State) {
+    if (State->Options->FlushMode <= FLUSH_SCREEN) {
+        flush_events(State, true);
+    }
+}
+
+static float square(float x) {
+    return x * x;
+}
+
+static int clamp(int a, int lower, int upper) {
+    return std::min(std::max(a, lower), upper);
+}
+
+static std::string replace_char(char* Str, char ToReplace, char ReplaceWith) {
+    char* Start = Str;
+    while (*Str) {
+        if (*Str == ToReplace) {
+            *Str = ReplaceWith;
+        }
+        Str++;
+    }
+    return std::string(Start);
+}
+
+static std::string trim(const std::string &String) {
+    const char* Str = String.c_str();
+    while (Str[0] && isspace(Str[0])) {
+        Str++;
+    }
+    const char* Ptr = Str;
+    while (*Ptr++);
+    while (Ptr > Str && !isspace(Ptr[0])) {
+        Ptr--;
+    }
+    return std::string(Str, Ptr - Str);
+}
+
+static void draw_indicator(uchar *Pixels, int Width, int Height, int x, int y) {
+    const uchar R = 0x00;
+    const uchar G = 0xFF;
+    const uchar B = 0x00;
+    const int size = 32;
+    int min_x = clamp(x - size / 2, 0, Width - 1);
+    int max_x = clamp(x + size / 2, 0, Width - 1);
+    int min_y = clamp(y - size / 2, 0, Height - 1);
+    int max_y = clamp(y + size / 2, 0, Height - 1);
+    for (int i = min_x; i < max_x; i++) {
+        Pixels[3 * (Width * y + i) + 0] = B;
+        Pixels[3 * (Width * y + i) + 1] = G;
+        Pixels[3 * (Width * y + i) + 2] = R;
+    }
+    for (int i = min_y; i < max_y; i++) {
+        Pixels[3 * (Width * i + x) + 0] = B;
+        Pixels[3 * (Width * i + x) + 1] = G;
+        Pixels[3 * (Width * i + x) + 2] = R;
+    }
+}
+
+static image_t image_from_cvmat(cv::Mat* M) {
+    image_t Result;
+    Result.Width = M->cols;
+    Result.Height = M->rows;
+    Result.Pixels = M->ptr(0, 0);
+    Result.Channels = 3;
+    Result.Pitch = Result.Channels * Result.Width;
+    return Result;
+}
+
+static image_t subimage(const image_t* Src, const rect_t* SubRect) {
+    image_t Result = *Src;
+    if (SubRect) {
+        Result.Pixels = Src->Pixels + Src->Channels * (SubRect->Y * Src->Width + SubRect->X);
+        Result.Width = SubRect->Width;
+        Result.Height = SubRect->Height;
+    }
+
+    return Result;
+}
+
+static void invert_image(image_t* Im) {
+    for (int y = 0; y < Im->Height; y++) {
+        uchar* Row = Im->Pixels + y * Im->Pitch;
+        for (int x = 0; x < Im->Width; x++) {
+            for (int Channel = 0; Channel < Im->Channels; Channel++) {
+                uchar* Pixel = Row + Im->Channels * x + Channel;
+                *Pixel = 255 - *Pixel;
+            }
+        }
+    }
+}
+
+static void to_grayscale(image_t* Im) {
+    for (int y = 0; y < Im->Height; y++) {
+        uchar* Row = Im->Pixels + y * Im->Pitch;
+        for (int x = 0; x < Im->Width; x++) {
+            uchar* Pixel = Row + Im->Channels * x;
+            uchar Value = clamp((int)(0.299f * Pixel[2] + 0.587f * Pixel[1] + 0.114f * Pixel[0]), 0, 255);
+            Pixel[0] = Pixel[1] = Pixel[2] = Value;
+        }
+    }
+}
+
+static void change_contrast(image_t* Im, float Contrast) {
+    for (int y = 0; y < Im->Height; y++) {
+        uchar* Row = Im->Pixels + y * Im->Pitch;
+        for (int x = 0; x < Im->Width; x++) {
+            for (int Channel = 0; Channel < Im->Channels; Channel++) {
+                uchar* Pixel = Row + Im->Channels * x + Channel;
+                float Value = Contrast * (Pixel[0] / 255.f - 1.f) + 1.f;
+                *Pixel = clamp((int)((Value + 0.5f) * 255.f), 0x00, 0xff);
+            }
+        }
+    }
+}
+
+// NOTE: The weapon screen shares the equipment UI of the stigmata screen, its highlight bars sit under
+// the weapon name instead of under the three stigmata. --signatures=FILE can override every entry.
+// NOTE: The stigmata and lineup signatures and the stigmata ROIs are measured. The others, battles included, are
+// provisional, laid out by hand and not yet measured on a reference capture, and stay disabled until
+// --signatures=FILE supplies them. --measure=<name> prints measured colors for a signature file, --verify checks
+// both tables against the reference frames of a corpus.
+static screen_signature_t ScreenSignatures[SCREEN_COUNT] = {
+    { "stigmata", EVENT_STIGMATA_SCREEN, 0.97f, 5, {
+        {  120, 200, 0xee, 0x9a, 0xff },
+        {  990, 864, 0xff, 0xdd, 0x47 },
+        { 1350, 864, 0xff, 0xdd, 0x47 },
+        { 1710, 864, 0xff, 0xdd, 0x47 },
+        { 1280, 974, 0x00, 0xc9, 0xff },
+    }, true },
+    { "weapon", EVENT_WEAPON_SCREEN, 0.97f, 5, {
+        {  120, 200, 0xee, 0x9a, 0xff },
+        {  990, 300, 0xff, 0xdd, 0x47 },
+        { 1350, 300, 0xff, 0xdd, 0x47 },
+        { 1710, 300, 0xff, 0xdd, 0x47 },
+        { 1280, 974, 0x00, 0xc9, 0xff },
+    }, false },
+    { "divine_key", EVENT_DIVINE_KEY_SCREEN, 0.97f, 5, {
+        {  120, 200, 0xee, 0x9a, 0xff },
+        {  268, 480, 0xff, 0xdd, 0x47 },
+        {  990, 864, 0x6e, 0x3c, 0xd2 },
+        { 1710, 864, 0x6e, 0x3c, 0xd2 },
+        { 1280, 974, 0x00, 0xc9, 0xff },
+    }, false },
+    { "lineup", EVENT_LINEUP_SCREEN, 0.97f, 5, {
+        { 1762, 168, 0xff, 0xdd, 0x47 },
+        { 1762, 390, 0xff, 0xdd, 0x47 },
+        { 1762, 608, 0xff, 0xdd, 0x47 },
+        {  181,  97, 0xff, 0xdb, 0x48 },
+        { 1520, 986, 0x00, 0x5a, 0x7e },
+    }, true },
+};
+
+static screen_signature_t BattleSignatures[BATTLE_COUNT] = {
+    { "abyss_battle", EVENT_ABYSS_BATTLE, 0.95f, 5, {
+        {   60,  52, 0xff, 0xff, 0xff },
+        {  920,  40, 0xff, 0xdd, 0x47 },
+        { 1000,  40, 0xff, 0xdd, 0x47 },
+        { 1720, 940, 0xff, 0xff, 0xff },
+        { 1580, 980, 0x00, 0xc9, 0xff },
+    }, false },
+    { "arena_battle", EVENT_ARENA_BATTLE, 0.95f, 5, {
+        {   60,  52, 0xff, 0xff, 0xff },
+        {  880,  72, 0xe0, 0x3c, 0x3c },
+        { 1040,  72, 0xe0, 0x3c, 0x3c },
+        { 1720, 940, 0xff, 0xff, 0xff },
+        { 1580, 980, 0x00, 0xc9, 0xff },
+    }, false },
+};
+
+static ocr_roi_layout_t StigmataRois[] = {
+    { "Valkyrie",     {  188, 912, 484,  72 }, OCR_PREPROCESS_CONTRAST_INVERT_GRAY, EVENT_VALKYRIE_NAME, true },
+    { "Stigmata (T)", {  872, 550, 284, 188 }, OCR_PREPROCESS_INVERT_CONTRAST,      EVENT_STIGMATA,      true },
+    { "Stigmata (M)", { 1232, 550, 284, 188 }, OCR_PREPROCESS_INVERT_CONTRAST,      EVENT_STIGMATA,      true },
+    { "Stigmata (B)", { 1592, 550, 284, 188 }, OCR_PREPROCESS_INVERT_CONTRAST,      EVENT_STIGMATA,      true },
+};
+
+static ocr_roi_layout_t WeaponRois[] = {
+    { "Valkyrie",     {  188, 912, 484,  72 }, OCR_PREPROCESS_CONTRAST_INVERT_GRAY, EVENT_VALKYRIE_NAME, false },
+    { "Weapon",       {  872, 180, 1004, 96 }, OCR_PREPROCESS_INVERT_CONTRAST,      EVENT_WEAPON,        false },
+};
+
+// NOTE: Only read if the icon does not match the icon library
+static ocr_roi_layout_t DivineKeyRois[] = {
+    { "Divine key",   {  412, 300, 800,  72 }, OCR_PREPROCESS_INVERT_CONTRAST,      EVENT_DIVINE_KEY,    false },
+};
+
+// NOTE: One card per valkyrie on the right, the ELF below the team on the left. Until these are measured a lineup
+// screen is only reported and dumped, as before it had ROIs.
+static ocr_roi_layout_t LineupRois[] = {
+    { "Valkyrie 1",   { 1160, 130, 560,  56 }, OCR_PREPROCESS_CONTRAST_INVERT_GRAY, EVENT_VALKYRIE_NAME, false },
+    { "Rank 1",       { 1160, 190, 120,  48 }, OCR_PREPROCESS_CONTRAST_INVERT_GRAY, EVENT_VALKYRIE_RANK, false },
+    { "Valkyrie 2",   { 1160, 352, 560,  56 }, OCR_PREPROCESS_CONTRAST_INVERT_GRAY, EVENT_VALKYRIE_NAME, false },
+    { "Rank 2",       { 1160, 412, 120,  48 }, OCR_PREPROCESS_CONTRAST_INVERT_GRAY, EVENT_VALKYRIE_RANK, false },
+    { "Valkyrie 3",   { 1160, 570, 560,  56 }, OCR_PREPROCESS_CONTRAST_INVERT_GRAY, EVENT_VALKYRIE_NAME, false },
+    { "Rank 3",       { 1160, 630, 120,  48 }, OCR_PREPROCESS_CONTRAST_INVERT_GRAY, EVENT_VALKYRIE_RANK, false },
+    { "ELF",          {  188, 800, 484,  72 }, OCR_PREPROCESS_INVERT_CONTRAST,      EVENT_ELF,           false },
+};
+
+static rect_t DivineKeyIconBox = { 188, 300, 160, 160 };
+static bool DivineKeyIconMeasured = false;
+
+// NOTE: The OCR ROIs of a screen, 0 for screens without any
+static ocr_roi_layout_t* screen_rois(int Screen, int* RoiCount) {
+    switch (Screen) {
+    case SCREEN_STIGMATA:   *RoiCount = ARRAY_COUNT(StigmataRois);  return StigmataRois;
+    case SCREEN_WEAPON:     *RoiCount = ARRAY_COUNT(WeaponRois);    return WeaponRois;
+    case SCREEN_DIVINE_KEY: *RoiCount = ARRAY_COUNT(DivineKeyRois); return DivineKeyRois;
+    case SCREEN_LINEUP:     *RoiCount = ARRAY_COUNT(LineupRois);    return LineupRois;
+    default:                *RoiCount = 0;                          return 0;
+    }
+}
+
+// NOTE: Provisional like the lineup ROIs, the fields are not sampled until a signature file measures them
+static ocr_roi_layout_t AbyssFields[] = {
+    { "Timer",        {  880,  84, 160,  44 }, OCR_PREPROCESS_INVERT_CONTRAST,      EVENT_BATTLE_TIMER,  false },
+    { "Score",        { 1640, 120, 240,  44 }, OCR_PREPROCESS_INVERT_CONTRAST,      EVENT_BATTLE_SCORE,  false },
+};
+
+static ocr_roi_layout_t ArenaFields[] = {
+    { "Timer",        {  900, 100, 120,  44 }, OCR_PREPROCESS_INVERT_CONTRAST,      EVENT_BATTLE_TIMER,  false },
+    { "Score",        { 1640, 120, 240,  44 }, OCR_PREPROCESS_INVERT_CONTRAST,      EVENT_BATTLE_SCORE,  false },
+};
+
+static ocr_roi_layout_t* battle_fields(int Battle, int* FieldCount) {
+    switch (Battle) {
+    case BATTLE_ABYSS: *FieldCount = ARRAY_COUNT(AbyssFields); return AbyssFields;
+    case BATTLE_ARENA: *FieldCount = ARRAY_COUNT(ArenaFields); return ArenaFields;
+    default:           *FieldCount = 0;                        return 0;
+    }
+}
+
+// NOTE: Loaded once before scanning starts and only read afterwards, so it is shared by all threads
+struct icon_library_t {
+    std::vector<std::string> Names;
+    std::vector<uchar> Thumbs;
+};
+
+static icon_library_t DivineKeyIcons;
+
+static void make_icon_thumb(const cv::Mat& Icon, uchar* Thumb) {
+    cv::Mat Scaled;
+    cv::resize(Icon, Scaled, cv::Size(ICON_THUMB_SIZE, ICON_THUMB_SIZE), 0, 0, cv::INTER_AREA);
+    for (int y = 0; y < ICON_THUMB_SIZE; y++) {
+        memcpy(Thumb + 3 * ICON_THUMB_SIZE * y, Scaled.ptr(y, 0), 3 * ICON_THUMB_SIZE);
+    }
+}
+
+// NOTE: Every <name>.png in Dir becomes an icon called <name>
+static bool load_icon_library(icon_library_t* Library, const char* Dir) {
+    std::error_code Error;
+    std::vector<std::filesystem::path> Paths;
+    for (std::filesystem::directory_iterator It(Dir, Error); !Error && It != std::filesystem::directory_iterator(); It.increment(Error)) {
+        if (It->path().extension() == ".png") {
+            Paths.push_back(It->path());
+        }
+    }
+    if (Error) {
+        LOGERROR("Could not list %s: %s\n", Dir, Error.message().c_str());
+        return false;
+    }
+    std::sort(Paths.begin(), Paths.end());
+
+    for (size_t i = 0; i < Paths.size(); i++) {
+        cv::Mat Icon = cv::imread(Paths[i].string(), cv::IMREAD_COLOR);
+        if (Icon.empty()) {
+            LOGWARN("Ignoring unreadable icon %s\n", Paths[i].string().c_str());
+            continue;
+        }
+        size_t Offset = Library->Thumbs.size();
+        Library->Thumbs.resize(Offset + 3 * ICON_THUMB_SIZE * ICON_THUMB_SIZE);
+        make_icon_thumb(Icon, Library->Thumbs.data() + Offset);
+        Library->Names.push_back(Paths[i].stem().string());
+    }
+    LOGMSG("Loaded %d icons from %s\n", (int)Library->Names.size(), Dir);
+    return true;
+}
+
+// NOTE: Sum of absolute differences, the SSE2 path handles 16 bytes per instruction
+static int sad_bytes(const uchar* A, const uchar* B, int Count) {
+    int Sum = 0;
+    int i = 0;
+#if WITH_SSE2
+    __m128i Sums = _mm_setzero_si128();
+    for (; i + 16 <= Count; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(A + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(B + i));
+        Sums = _mm_add_epi64(Sums, _mm_sad_epu8(a, b));
+    }
+    Sum = _mm_cvtsi128_si32(Sums) + _mm_cvtsi128_si32(_mm_srli_si128(Sums, 8));
+#endif
+    for (; i < Count; i++) {
+        Sum += abs((int)A[i] - (int)B[i]);
+    }
+    return Sum;
+}
+
+// NOTE: Returns the index of the closest icon or -1 if none is close enough, Confidence is in [0, 100]
+static int match_icon(const icon_library_t* Library, cv::Mat* Frame, const rect_t* Box, int* Confidence) {
+    const int ThumbBytes = 3 * ICON_THUMB_SIZE * ICON_THUMB_SIZE;
+    uchar Thumb[3 * ICON_THUMB_SIZE * ICON_THUMB_SIZE];
+    make_icon_thumb((*Frame)(cv::Rect(Box->X, Box->Y, Box->Width, Box->Height)), Thumb);
+
+    int Best = -1;
+    int BestDistance = ICON_MAX_MEAN_DIFF * ThumbBytes + 1;
+    for (int i = 0; i < (int)Library->Names.size(); i++) {
+        int Distance = sad_bytes(Thumb, Library->Thumbs.data() + i * ThumbBytes, ThumbBytes);
+        if (Distance < BestDistance) {
+            Best = i;
+            BestDistance = Distance;
+        }
+    }
+    *Confidence = Best >= 0 ? 100 - (100 * BestDistance) / (255 * ThumbBytes) : 0;
+    return Best;
+}
+
+// NOTE: Glyphs are ink masks scaled to DIGIT_GLYPH_HEIGHT, keeping their aspect ratio and centered horizontally
+struct digit_templates_t {
+    uchar Glyphs[10][DIGIT_GLYPH_BYTES];
+    bool Valid[10];
+};
+
+static digit_templates_t DigitTemplates;
+
+// NOTE: Set by --capture-digits=DIR, battle fields tesseract read confidently donate their glyphs to DIR
+static std::string DigitCaptureDir;
+static std::mutex DigitCaptureMutex;
+
+// NOTE: A glyph of a field, Kind is ':' or '.' for separators and 0 for a digit
+struct glyph_t {
+    cv::Rect Box;
+    char Kind;
+};
+
+static cv::Mat ink_mask(const cv::Mat& Image) {
+    cv::Mat Mask(Image.rows, Image.cols, CV_8UC1);
+    for (int y = 0; y < Image.rows; y++) {
+        const uchar* Src = Image.ptr(y, 0);
+        uchar* Dst = Mask.ptr(y, 0);
+        for (int x = 0; x < Image.cols; x++) {
+            Dst[x] = std::min(std::min(Src[3 * x], Src[3 * x + 1]), Src[3 * x + 2]) >= DIGIT_INK_THRESHOLD ? 0xff : 0;
+        }
+    }
+    return Mask;
+}
+
+static bool row_has_ink(const cv::Mat& Mask, int y, int X0, int X1) {
+    const uchar* Row = Mask.ptr(y, 0);
+    for (int x = X0; x < X1; x++) {
+        if (Row[x]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool column_has_ink(const cv::Mat& Mask, int x) {
+    for (int y = 0; y < Mask.rows; y++) {
+        if (Mask.ptr(y, 0)[x]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// NOTE: The rows [*Y0, *Y1) contain all ink of the columns [X0, X1), false if there is none
+static bool ink_rows(const cv::Mat& Mask, int X0, int X1, int* Y0, int* Y1) {
+    *Y0 = 0;
+    while (*Y0 < Mask.rows && !row_has_ink(Mask, *Y0, X0, X1)) {
+        (*Y0)++;
+    }
+    *Y1 = Mask.rows;
+    while (*Y1 > *Y0 && !row_has_ink(Mask, *Y1 - 1, X0, X1)) {
+        (*Y1)--;
+    }
+    return *Y0 < *Y1;
+}
+
+static void normalize_glyph(const cv::Mat& Mask, cv::Rect Box, uchar* Glyph) {
+    int Width = clamp((Box.width * DIGIT_GLYPH_HEIGHT + Box.height / 2) / Box.height, 1, DIGIT_GLYPH_WIDTH);
+    cv::Mat Scaled;
+    cv::resize(Mask(Box), Scaled, cv::Size(Width, DIGIT_GLYPH_HEIGHT), 0, 0, cv::INTER_AREA);
+
+    memset(Glyph, 0, DIGIT_GLYPH_BYTES);
+    int X = (DIGIT_GLYPH_WIDTH - Width) / 2;
+    for (int y = 0; y < DIGIT_GLYPH_HEIGHT; y++) {
+        memcpy(Glyph + DIGIT_GLYPH_WIDTH * y + X, Scaled.ptr(y, 0), Width);
+    }
+}
+
+static void set_digit_template(digit_templates_t* Templates, int Digit, const cv::Mat& Image) {
+    cv::Mat Mask = ink_mask(Image);
+    int X0 = 0;
+    int X1 = Mask.cols;
+    while (X0 < X1 && !column_has_ink(Mask, X0)) {
+        X0++;
+    }
+    while (X1 > X0 && !column_has_ink(Mask, X1 - 1)) {
+        X1--;
+    }
+    int Y0, Y1;
+    Templates->Valid[Digit] = ink_rows(Mask, X0, X1, &Y0, &Y1);
+    if (Templates->Valid[Digit]) {
+        normalize_glyph(Mask, cv::Rect(X0, Y0, X1 - X0, Y1 - Y0), Templates->Glyphs[Digit]);
+    }
+}
+
+static bool have_digit_templates(const digit_templates_t* Templates) {
+    for (int Digit = 0; Digit < 10; Digit++) {
+        if (!Templates->Valid[Digit]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// NOTE: Expects <Dir>/0.png to <Dir>/9.png, each showing one white digit as cut from real footage or written by
+// --capture-digits
+static bool load_digit_templates(digit_templates_t* Templates, const char* Dir) {
+    for (int Digit = 0; Digit < 10; Digit++) {
+        std::string Path = std::string(Dir) + "/" + (char)('0' + Digit) + ".png";
+        cv::Mat Image = cv::imread(Path, cv::IMREAD_COLOR);
+        if (Image.empty()) {
+            LOGERROR("Could not read digit template %s\n", Path.c_str());
+            return false;
+        }
+        set_digit_template(Templates, Digit, Image);
+        if (!Templates->Valid[Digit]) {
+            LOGERROR("Digit template %s has no ink\n", Path.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// NOTE: Splits the field mask into glyphs at ink-free columns, ':' and '.' are told apart from digits by their shape
+static void split_glyphs(const cv::Mat& Mask, std::vector<glyph_t>* Glyphs) {
+    Glyphs->clear();
+    int FieldY0, FieldY1;
+    if (!ink_rows(Mask, 0, Mask.cols, &FieldY0, &FieldY1)) {
+        return;
+    }
+
+    std::vector<uchar> ColumnInk(Mask.cols, 0);
+    for (int y = FieldY0; y < FieldY1; y++) {
+        const uchar* Row = Mask.ptr(y, 0);
+        for (int x = 0; x < Mask.cols; x++) {
+            ColumnInk[x] |= Row[x];
+        }
+    }
+
+    for (int x = 0; x < Mask.cols;) {
+        if (!ColumnInk[x]) {
+            x++;
+            continue;
+        }
+        int X0 = x;
+        while (x < Mask.cols && ColumnInk[x]) {
+            x++;
+        }
+        int Y0, Y1;
+        ink_rows(Mask, X0, x, &Y0, &Y1);
+        bool Gap = false;
+        for (int y = Y0; y < Y1 && !Gap; y++) {
+            Gap = !row_has_ink(Mask, y, X0, x);
+        }
+        glyph_t Glyph;
+        Glyph.Box = cv::Rect(X0, Y0, x - X0, Y1 - Y0);
+        Glyph.Kind = Gap ? ':' : 2 * (Y1 - Y0) < FieldY1 - FieldY0 ? '.' : 0;
+        Glyphs->push_back(Glyph);
+    }
+}
+
+// NOTE: Matches every digit glyph of the field against the templates. Returns false if a glyph matches no template,
+// an empty field gives an empty Text. Confidence is the one of the worst glyph.
+static bool read_digits(const digit_templates_t* Templates, cv::Mat* Frame, const rect_t* Box, std::string* Text, int* Confidence) {
+    TIME_STAGE(STAGE_DIGITS);
+    cv::Mat Mask = ink_mask((*Frame)(cv::Rect(Box->X, Box->Y, Box->Width, Box->Height)));
+    Text->clear();
+    *Confidence = 100;
+    std::vector<glyph_t> Glyphs;
+    split_glyphs(Mask, &Glyphs);
+    for (size_t i = 0; i < Glyphs.size(); i++) {
+        if (Glyphs[i].Kind) {
+            *Text += Glyphs[i].Kind;
+            continue;
+        }
+
+        uchar Glyph[DIGIT_GLYPH_BYTES];
+        normalize_glyph(Mask, Glyphs[i].Box, Glyph);
+        int Best = -1;
+        int BestDistance = DIGIT_MAX_MEAN_DIFF * DIGIT_GLYPH_BYTES + 1;
+        for (int Digit = 0; Digit < 10; Digit++) {
+            if (!Templates->Valid[Digit]) {
+                continue;
+            }
+            int Distance = sad_bytes(Glyph, Templates->Glyphs[Digit], DIGIT_GLYPH_BYTES);
+            if (Distance < BestDistance) {
+                Best = Digit;
+                BestDistance = Distance;
+            }
+        }
+        if (Best < 0) {
+            return false;
+        }
+        *Text += (char)('0' + Best);
+        *Confidence = std::min(*Confidence, 100 - (100 * BestDistance) / (255 * DIGIT_GLYPH_BYTES));
+    }
+    return true;
+}
+
+// NOTE: Saves the digit glyphs of a field tesseract read as Text to <DigitCaptureDir>/<digit>.png. Digits that were
+// captured before are kept, the field is skipped if its glyphs don't line up with Text.
+static void capture_digit_glyphs(cv::Mat* Frame, const rect_t* Box, const std::string& Text, int FrameIndex) {
+    cv::Mat Field = (*Frame)(cv::Rect(Box->X, Box->Y, Box->Width, Box->Height));
+    std::vector<glyph_t> Glyphs;
+    split_glyphs(ink_mask(Field), &Glyphs);
+    if (Glyphs.size() != Text.size()) {
+        return;
+    }
+    for (size_t i = 0; i < Glyphs.size(); i++) {
+        if (Glyphs[i].Kind ? Glyphs[i].Kind != Text[i] : (Text[i] < '0' || Text[i] > '9')) {
+            return;
+        }
+    }
+
+    std::lock_guard<std::mutex> Lock(DigitCaptureMutex);
+    for (size_t i = 0; i < Glyphs.size(); i++) {
+        std::string Path = DigitCaptureDir + "/" + Text[i] + ".png";
+        if (Glyphs[i].Kind || std::filesystem::exists(Path)) {
+            continue;
+        }
+        if (cv::imwrite(Path, Field(Glyphs[i].Box))) {
+            LOGMSG("Frame number %d: captured digit %c to %s\n", FrameIndex, Text[i], Path.c_str());
+        }
+        else {
+            LOGWARN("Could not write digit template %s\n", Path.c_str());
+        }
+    }
+}
+
+static viewport_t full_viewport(const cv::Mat& Frame) {
+    return { 0, 0, Frame.cols, Frame.rows };
+}
+
+static int map_x(const viewport_t* Viewport, int x) {
+    return Viewport->X + x * Viewport->Width / REFERENCE_WIDTH;
+}
+
+static int map_y(const viewport_t* Viewport, int y) {
+    return Viewport->Y + y * Viewport->Height / REFERENCE_HEIGHT;
+}
+
+static rect_t map_rect(const viewport_t* Viewport, const rect_t* Box) {
+    int X0 = map_x(Viewport, Box->X);
+    int Y0 = map_y(Viewport, Box->Y);
+    int X1 = map_x(Viewport, Box->X + Box->Width);
+    int Y1 = map_y(Viewport, Box->Y + Box->Height);
+    return { X0, Y0, std::max(X1 - X0, 1), std::max(Y1 - Y0, 1) };
+}
+
+// NOTE: Pixel is BGR, the distance is in [0, 1]
+static float pixel_distance(const uchar* Pixel, const test_pixel_t* TestPixel) {
+    uchar B = Pixel[0];
+    uchar G = Pixel[1];
+    uchar R = Pixel[2];
+
+    float RDelta = 2.f * (0xff + R - TestPixel->Color[0]) / 510.f - 1.f;
+    float GDelta = 2.f * (0xff + G - TestPixel->Color[1]) / 510.f - 1.f;
+    float BDelta = 2.f * (0xff + B - TestPixel->Color[2]) / 510.f - 1.f;
+    return sqrtf(square(RDelta) + square(GDelta) + square(BDelta)) / 3.f;
+}
+
+static bool screen_test(cv::Mat* Frame, const viewport_t* Viewport, const test_pixel_t *TestPixels, int TestPixelCount, float ThresholdConfidence) {
+    TIME_STAGE(STAGE_SCREEN_TEST);
+    float Indicator = 0;
+    for (int i = 0; i < TestPixelCount; i++) {
+        const test_pixel_t* TestPixel = TestPixels + i;
+        const uchar* Pixel = Frame->ptr(map_y(Viewport, TestPixel->y), map_x(Viewport, TestPixel->x));
+        Indicator += pixel_distance(Pixel, TestPixel) / TestPixelCount;
+    }
+
+    bool Result = (1.f - Indicator) >= ThresholdConfidence;
+#if WITH_VIDEO
+    if (Result) {
+        for (int i = 0; i < TestPixelCount; i++) {
+            const test_pixel_t* TestPixel = TestPixels + i;
+            for (int y = -1; y <= 1; y++) {
+                for (int x = -1; x <= 1; x++) {
+                    draw_indicator(Frame->ptr(0, 0), Frame->cols, Frame->rows, map_x(Viewport, TestPixel->x) + x, map_y(Viewport, TestPixel->y) + y);
+                }
+            }
+        }
+    }
+#endif
+
+    return Result;
+}
+
+static int classify_screen(cv::Mat* Frame, const viewport_t* Viewport) {
+    for (int Screen = 0; Screen < SCREEN_COUNT; Screen++) {
+        const screen_signature_t* Signature = ScreenSignatures + Screen;
+        if (Signature->Measured && screen_test(Frame, Viewport, Signature->Pixels, Signature->PixelCount, Signature->Threshold)) {
+            return Screen;
+        }
+    }
+    return SCREEN_NONE;
+}
+
+static int classify_battle(cv::Mat* Frame, const viewport_t* Viewport) {
+    for (int Battle = 0; Battle < BATTLE_COUNT; Battle++) {
+        const screen_signature_t* Signature = BattleSignatures + Battle;
+        if (Signature->Measured && screen_test(Frame, Viewport, Signature->Pixels, Signature->PixelCount, Signature->Threshold)) {
+            return Battle;
+        }
+    }
+    return BATTLE_NONE;
+}
+
+// NOTE: The ROIs of a screen or the fields of a battle
+static ocr_roi_layout_t* signature_rois(const screen_signature_t* Signature, int* RoiCount) {
+    if (Signature >= ScreenSignatures && Signature < ScreenSignatures + SCREEN_COUNT) {
+        return screen_rois((int)(Signature - ScreenSignatures), RoiCount);
+    }
+    return battle_fields((int)(Signature - BattleSignatures), RoiCount);
+}
+
+static bool inside_reference(const rect_t* Box) {
+    return Box->X >= 0 && Box->Y >= 0 && Box->Width > 0 && Box->Height > 0 && Box->X + Box->Width <= REFERENCE_WIDTH && Box->Y + Box->Height <= REFERENCE_HEIGHT;
+}
+
+static screen_signature_t* find_signature(const char* Name) {
+    for (int Screen = 0; Screen < SCREEN_COUNT; Screen++) {
+        if (strcmp(ScreenSignatures[Screen].Name, Name) == 0) {
+            return ScreenSignatures + Screen;
+        }
+    }
+    for (int Battle = 0; Battle < BATTLE_COUNT; Battle++) {
+        if (strcmp(BattleSignatures[Battle].Name, Name) == 0) {
+            return BattleSignatures + Battle;
+        }
+    }
+    return 0;
+}
+
+// NOTE: "screen <name> <threshold>" replaces the signature of a screen with the "pixel <x> <y> <rrggbb>"
+// lines that follow it and enables it, screens that are not mentioned keep their built-in signature.
+// "rois <name>" selects a screen without touching its pixels. After either, "roi <n> <x> <y> <w> <h>" measures
+// ROI n (from 1, in table order) of the screen and "icon <x> <y> <w> <h>" the divine key icon.
+static bool load_screen_signatures(const char* Path) {
+    FILE* File = fopen(Path, "r");
+    if (!File) {
+        LOGERROR("Could not open %s\n", Path);
+        return false;
+    }
+
+    screen_signature_t* Signature = 0;
+    char Line[256];
+    int LineNumber = 0;
+    bool Ok = true;
+    while (Ok && fgets(Line, sizeof(Line), File)) {
+        LineNumber++;
+        char Name[64];
+        float Threshold;
+        test_pixel_t Pixel;
+        unsigned int Color;
+        int Roi;
+        rect_t Box;
+        if (Line[0] == '#' || Line[strspn(Line, " \t\r\n")] == 0) {
+            continue;
+        }
+        if (sscanf(Line, "screen %63s %f", Name, &Threshold) == 2) {
+            Signature = find_signature(Name);
+            if (Signature) {
+                Signature->Threshold = Threshold;
+                Signature->PixelCount = 0;
+                Signature->Measured = true;
+            }
+            Ok = Signature != 0;
+        }
+        else if (sscanf(Line, "rois %63s", Name) == 1) {
+            Signature = find_signature(Name);
+            Ok = Signature != 0;
+        }
+        else if (sscanf(Line, "roi %d %d %d %d %d", &Roi, &Box.X, &Box.Y, &Box.Width, &Box.Height) == 5) {
+            int RoiCount = 0;
+            ocr_roi_layout_t* Rois = Signature ? signature_rois(Signature, &RoiCount) : 0;
+            Ok = Roi >= 1 && Roi <= RoiCount && inside_reference(&Box);
+            if (Ok) {
+                Rois[Roi - 1].Box = Box;
+                Rois[Roi - 1].Measured = true;
+            }
+        }
+        else if (sscanf(Line, "icon %d %d %d %d", &Box.X, &Box.Y, &Box.Width, &Box.Height) == 4) {
+            Ok = Signature == ScreenSignatures + SCREEN_DIVINE_KEY && inside_reference(&Box);
+            if (Ok) {
+                DivineKeyIconBox = Box;
+                DivineKeyIconMeasured = true;
+            }
+        }
+        else if (sscanf(Line, "pixel %d %d %x", &Pixel.x, &Pixel.y, &Color) == 3) {
+            Ok = Signature && Signature->PixelCount < SCREEN_SIGNATURE_MAX_PIXELS && Pixel.x >= 0 && Pixel.x < REFERENCE_WIDTH && Pixel.y >= 0 && Pixel.y < REFERENCE_HEIGHT;
+            if (Ok) {
+                Pixel.Color[0] = (uchar)(Color >> 16);
+                Pixel.Color[1] = (uchar)(Color >> 8);
+                Pixel.Color[2] = (uchar)Color;
+                Signature->Pixels[Signature->PixelCount++] = Pixel;
+            }
+        }
+        else {
+            Ok = false;
+        }
+    }
+    fclose(File);
+
+    for (int Screen = 0; Ok && Screen < SCREEN_COUNT; Screen++) {
+        Ok = ScreenSignatures[Screen].PixelCount > 0;
+    }
+    for (int Battle = 0; Ok && Battle < BATTLE_COUNT; Battle++) {
+        Ok = BattleSignatures[Battle].PixelCount > 0;
+    }
+    if (!Ok) {
+        LOGERROR("Invalid screen signature in %s:%d\n", Path, LineNumber);
+    }
+    return Ok;
+}
+
+static const char* ocr_rung_name(int Rung) {
+    switch (Rung) {
+    case OCR_RUNG_SINGLE_PASS:     return "single pass";
+    case OCR_RUNG_CONTRAST:        return "contrast";
+    case OCR_RUNG_UPSCALE:         return "upscale";
+    case OCR_RUNG_ALTERNATE_FRAME: return "alternate frame";
+    case OCR_RUNG_UNRESOLVED:      return "unresolved";
+    default:                       return "?";
+    }
+}
+
+// NOTE: Works on a copy of the ROI so that retries always start from the unprocessed pixels
+static int ocr_attempt(ocr_engine_t* Engine, const image_t* Image, const ocr_roi_t* Roi, float Contrast, int Scale, std::string* Text) {
+    tesseract::TessBaseAPI* Tess = acquire_tess(Engine);
+    if (!Tess) {
+        Text->clear();
+        return -1;
+    }
+
+    const rect_t* Box = &Roi->Box;
+    cv::Mat Scratch;
+    image_t Im;
+    {
+        TIME_STAGE(STAGE_PREPROCESS);
+        image_t Src = subimage(Image, Box);
+        cv::Mat SrcMat(Src.Height, Src.Width, CV_8UC3, Src.Pixels, Src.Pitch);
+        if (Scale > 1) {
+            cv::resize(SrcMat, Scratch, cv::Size(Scale * Box->Width, Scale * Box->Height), 0, 0, cv::INTER_CUBIC);
+        }
+        else {
+            SrcMat.copyTo(Scratch);
+        }
+
+        Im = image_from_cvmat(&Scratch);
+        switch (Roi->Preprocess) {
+        case OCR_PREPROCESS_CONTRAST_INVERT_GRAY:
+            change_contrast(&Im, Contrast);
+            invert_image(&Im);
+            to_grayscale(&Im);
+            break;
+        case OCR_PREPROCESS_INVERT_CONTRAST:
+            invert_image(&Im);
+            change_contrast(&Im, Contrast);
+            break;
+        }
+    }
+
+    TIME_STAGE(STAGE_OCR);
+    count_stat(COUNTER_OCR_CALLS);
+    if (Roi->Whitelist) {
+        Tess->SetVariable("tessedit_char_whitelist", Roi->Whitelist);
+    }
+    Tess->SetImage(Im.Pixels, Im.Width, Im.Height, Im.Channels, Im.Pitch);
+    Tess->Recognize(0);
+    char* Str = Tess->GetUTF8Text();
+    *Text = trim(replace_char(Str, '\n', ' '));
+    delete[] Str;
+    int Confidence = Tess->MeanTextConf();
+    Tess->Clear();
+    if (Roi->Whitelist) {
+        Tess->SetVariable("tessedit_char_whitelist", "");
+    }
+
+    return Confidence;
+}
+
+static bool ocr_try(ocr_engine_t* Engine, const image_t* Image, ocr_roi_t* Roi, int Rung, float Contrast, int Scale) {
+    std::string Text;
+    int Confidence = ocr_attempt(Engine, Image, Roi, Contrast, Scale, &Text);
+    if (Confidence > Roi->Confidence) {
+        Roi->Confidence = Confidence;
+        Roi->Contrast = Contrast;
+        Roi->Text = Text;
+    }
+    if (Confidence >= OCR_CONFIDENCE_THRESHOLD) {
+        Roi->Resolved = true;
+        Roi->Rung = Rung;
+    }
+
+    return Roi->Resolved;
+}
+
+// NOTE: Alternate frames are handled by continue_ocr_scan, since they only arrive with later frames
+static void ocr_ladder(ocr_engine_t* Engine, const image_t* Image, ocr_roi_t* Roi) {
+    const float DefaultContrast = 4.f;
+    const float AlternateContrasts[] = { 2.f, 8.f };
+
+    if (ocr_try(Engine, Image, Roi, OCR_RUNG_SINGLE_PASS, DefaultContrast, 1)) {
+        return;
+    }
+    for (int i = 0; i < (int)ARRAY_COUNT(AlternateContrasts); i++) {
+        if (ocr_try(Engine, Image, Roi, OCR_RUNG_CONTRAST, AlternateContrasts[i], 1)) {
+            return;
+        }
+    }
+    ocr_try(Engine, Image, Roi, OCR_RUNG_UPSCALE, Roi->Contrast, OCR_UPSCALE_FACTOR);
+}
+
+static void init_ocr_roi(ocr_roi_t* Roi, const char* Name, rect_t Box, ocr_preprocess_t Preprocess, event_type_t EventType) {
+    Roi->Name = Name;
+    Roi->Box = Box;
+    Roi->Preprocess = Preprocess;
+    Roi->EventType = EventType;
+    Roi->Whitelist = 0;
+    Roi->Resolved = false;
+    Roi->Rung = OCR_RUNG_UNRESOLVED;
+    Roi->Confidence = -1;
+    Roi->Contrast = 4.f;
+    Roi->Text.clear();
+}
+
+static bool all_rois_resolved(const ocr_scan_t* Scan) {
+    for (int i = 0; i < Scan->RoiCount; i++) {
+        if (!Scan->Rois[i].Resolved) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void finish_ocr_scan(state_t* State) {
+    ocr_scan_t* Scan = &State->Scan;
+    if (!Scan->Active) {
+        return;
+    }
+
+    for (int i = 0; i < Scan->RoiCount; i++) {
+        ocr_roi_t* Roi = Scan->Rois + i;
+        int Rung = Roi->Resolved ? Roi->Rung : OCR_RUNG_UNRESOLVED;
+        State->OcrRungHistogram[Rung]++;
+        LOGMSG("%s: %s (confidence %d, %s)\n", Roi->Name, Roi->Text.c_str(), Roi->Confidence, ocr_rung_name(Rung));
+        add_event_at(State, Roi->EventType, Roi->Text, Scan->Frame, Scan->Ms, std::max(Roi->Confidence, 0));
+    }
+    Scan->Active = false;
+    end_of_screen(State);
+}
+
+// NOTE: Sheets are named after the frame of their first tile, so the sheets of batch segments never collide
+static void write_contact_sheet(state_t* State) {
+    contact_sheet_t* Sheet = &State->Sheet;
+    if (Sheet->TileCount == 0) {
+        return;
+    }
+
+    int Rows = (Sheet->TileCount + SHEET_COLUMNS - 1) / SHEET_COLUMNS;
+    int Unused = Rows * SHEET_COLUMNS - Sheet->TileCount;
+    if (Unused > 0) {
+        cv::Rect Rest((SHEET_COLUMNS - Unused) * SHEET_TILE_WIDTH, (Rows - 1) * SHEET_TILE_HEIGHT, Unused * SHEET_TILE_WIDTH, SHEET_TILE_HEIGHT);
+        Sheet->Canvas(Rest).setTo(cv::Scalar::all(0));
+    }
 
     char Buffer[256];
-    snprintf(Buffer, sizeof(Buffer), "%s/lineup_frame_%d.png", "./Output", LineupFrameIndex++);
-    cv::imwrite(Buffer, *RefFrame);
+    snprintf(Buffer, sizeof(Buffer), "%s/sheet_%d.jpg", State->Options->OutputDir.c_str(), Sheet->FirstFrame);
+    TIME_STAGE(STAGE_IMWRITE);
+    if (!cv::imwrite(Buffer, Sheet->Canvas(cv::Rect(0, 0, SHEET_COLUMNS * SHEET_TILE_WIDTH, Rows * SHEET_TILE_HEIGHT)), { cv::IMWRITE_JPEG_QUALITY, SHEET_JPEG_QUALITY })) {
+        LOGWARN("Could not write contact sheet %s\n", Buffer);
+    }
+    Sheet->TileCount = 0;
+}
+
+static void add_sheet_tile(state_t* State, cv::Mat* RefFrame, int Screen) {
+    contact_sheet_t* Sheet = &State->Sheet;
+    if (Sheet->Canvas.empty()) {
+        Sheet->Canvas.create(SHEET_MAX_TILES / SHEET_COLUMNS * SHEET_TILE_HEIGHT, SHEET_COLUMNS * SHEET_TILE_WIDTH, CV_8UC3);
+    }
+    if (Sheet->TileCount == 0) {
+        Sheet->FirstFrame = State->FrameIndex;
+    }
+
+    // NOTE: The tile is a view into the canvas, resize writes straight into it
+    cv::Rect Box((Sheet->TileCount % SHEET_COLUMNS) * SHEET_TILE_WIDTH, (Sheet->TileCount / SHEET_COLUMNS) * SHEET_TILE_HEIGHT, SHEET_TILE_WIDTH, SHEET_TILE_HEIGHT);
+    cv::Mat Tile = Sheet->Canvas(Box);
+    {
+        TIME_STAGE(STAGE_RESIZE);
+        cv::resize(*RefFrame, Tile, Tile.size(), 0, 0, cv::INTER_AREA);
+    }
+    char Label[64];
+    snprintf(Label, sizeof(Label), "%s %d", ScreenSignatures[Screen].Name, State->FrameIndex);
+    cv::putText(Tile, Label, cv::Point(6, SHEET_TILE_HEIGHT - 8), cv::FONT_HERSHEY_SIMPLEX, 0.45, cv::Scalar::all(255), 1, cv::LINE_AA);
+
+    if (++Sheet->TileCount == SHEET_MAX_TILES) {
+        write_contact_sheet(State);
+    }
+}
+
+static void dump_screen_frame(state_t* State, cv::Mat* RefFrame, int Screen) {
+    if (State->Options->DumpFrames) {
+        char Buffer[256];
+        snprintf(Buffer, sizeof(Buffer), "%s/%s_frame_%d.png", State->Options->OutputDir.c_str(), ScreenSignatures[Screen].Name, State->DumpIndex[Screen]++);
+        TIME_STAGE(STAGE_IMWRITE);
+        cv::imwrite(Buffer, *RefFrame);
+    }
+    if (State->Options->ContactSheet) {
+        add_sheet_tile(State, RefFrame, Screen);
+    }
+}
+
+// NOTE: Emits the screen event right away, the ROI events follow once the scan is finished. Unmeasured ROIs are
+// skipped, a screen without measured ones only reports itself and dumps its frame.
+static void scan_ocr_screen(state_t* State, cv::Mat* RefFrame, int Screen, const ocr_roi_layout_t* Layout, int RoiCount) {
+    add_event(State, ScreenSignatures[Screen].EventType);
+
+    char Message[64];
+    snprintf(Message, sizeof(Message), "%s screen", ScreenSignatures[Screen].Name);
+    Message[0] = (char)toupper(Message[0]);
+    log_timestamp(State, Message);
+
+    image_t Image = image_from_cvmat(RefFrame);
+    ocr_scan_t* Scan = &State->Scan;
+    Scan->Active = true;
+    Scan->Screen = Screen;
+    Scan->Frame = State->FrameIndex;
+    Scan->Ms = State->FrameMs;
+    Scan->FramesSinceScan = 0;
+    Scan->AlternateFrames = 0;
+    Scan->RoiCount = 0;
+    for (int i = 0; i < RoiCount && Scan->RoiCount < OCR_SCAN_MAX_ROIS; i++) {
+        if (Layout[i].Measured) {
+            init_ocr_roi(&Scan->Rois[Scan->RoiCount++], Layout[i].Name, map_rect(&State->Viewport, &Layout[i].Box), Layout[i].Preprocess, Layout[i].EventType);
+        }
+    }
+
+    run_ocr_tasks(State, Scan->RoiCount, [Scan, &Image](ocr_engine_t* Engine, int i) {
+        ocr_ladder(Engine, &Image, Scan->Rois + i);
+    });
+
+    dump_screen_frame(State, RefFrame, Screen);
+
+    if (all_rois_resolved(Scan)) {
+        finish_ocr_scan(State);
+    }
+}
+
+// NOTE: Called for every further frame of the same appearance, retries the ROIs the ladder could not resolve
+static void continue_ocr_scan(state_t* State, cv::Mat* RefFrame) {
+    ocr_scan_t* Scan = &State->Scan;
+    if (!Scan->Active || ++Scan->FramesSinceScan < OCR_ALTERNATE_FRAME_STRIDE) {
+        return;
+    }
+
+    Scan->FramesSinceScan = 0;
+    Scan->AlternateFrames++;
+    image_t Image = image_from_cvmat(RefFrame);
+    ocr_roi_t* Unresolved[OCR_SCAN_MAX_ROIS];
+    int UnresolvedCount = 0;
+    for (int i = 0; i < Scan->RoiCount; i++) {
+        if (!Scan->Rois[i].Resolved) {
+            Unresolved[UnresolvedCount++] = Scan->Rois + i;
+        }
+    }
+    run_ocr_tasks(State, UnresolvedCount, [&Unresolved, &Image](ocr_engine_t* Engine, int i) {
+        ocr_try(Engine, &Image, Unresolved[i], OCR_RUNG_ALTERNATE_FRAME, Unresolved[i]->Contrast, 1);
+    });
+
+    if (all_rois_resolved(Scan) || Scan->AlternateFrames >= OCR_MAX_ALTERNATE_FRAMES) {
+        finish_ocr_scan(State);
+    }
+}
+
+static void log_ocr_histogram(const state_t* State) {
+    LOGMSG("OCR retry ladder:\n");
+    for (int Rung = 0; Rung < OCR_RUNG_COUNT; Rung++) {
+        LOGMSG("  %-16s %d\n", ocr_rung_name(Rung), State->OcrRungHistogram[Rung]);
+    }
+}
+
+// NOTE: A known icon costs one thumbnail and a few SADs, unknown keys fall back to reading the name. Icons are only
+// matched once the icon box is measured.
+static void scan_divine_key_screen(state_t* State, cv::Mat* RefFrame) {
+    int Confidence = 0;
+    int Icon = -1;
+    if (DivineKeyIconMeasured) {
+        rect_t IconBox = map_rect(&State->Viewport, &DivineKeyIconBox);
+        Icon = match_icon(&DivineKeyIcons, RefFrame, &IconBox, &Confidence);
+    }
+    if (Icon < 0) {
+        int RoiCount;
+        const ocr_roi_layout_t* Rois = screen_rois(SCREEN_DIVINE_KEY, &RoiCount);
+        scan_ocr_screen(State, RefFrame, SCREEN_DIVINE_KEY, Rois, RoiCount);
+        return;
+    }
+
+    add_event(State, EVENT_DIVINE_KEY_SCREEN);
+    log_timestamp(State, "Divine key screen");
+    LOGMSG("Divine key: %s (icon, confidence %d)\n", DivineKeyIcons.Names[Icon].c_str(), Confidence);
+    add_event_at(State, EVENT_DIVINE_KEY, DivineKeyIcons.Names[Icon], State->FrameIndex, State->FrameMs, Confidence);
+    dump_screen_frame(State, RefFrame, SCREEN_DIVINE_KEY);
+    end_of_screen(State);
+}
+
+// NOTE: Called on the first frame of a screen appearance
+static void begin_screen(state_t* State, cv::Mat* RefFrame, int Screen) {
+    int RoiCount;
+    const ocr_roi_layout_t* Rois = screen_rois(Screen, &RoiCount);
+    switch (Screen) {
+    case SCREEN_STIGMATA:
+    case SCREEN_WEAPON:
+    case SCREEN_LINEUP:
+        scan_ocr_screen(State, RefFrame, Screen, Rois, RoiCount);
+        break;
+    case SCREEN_DIVINE_KEY:
+        scan_divine_key_screen(State, RefFrame);
+        break;
+    }
+}
+
+// NOTE: Called on every further frame of the same appearance
+static void continue_screen(state_t* State, cv::Mat* RefFrame, int Screen) {
+    if (State->Scan.Active && State->Scan.Screen == Screen) {
+        continue_ocr_scan(State, RefFrame);
+    }
+}
+
+// NOTE: The fallback for fields the templates can't read, and the only reader as long as no templates are loaded
+static int read_digits_tesseract(ocr_engine_t* Engine, cv::Mat* Frame, const ocr_roi_layout_t* Field, rect_t Box, std::string* Text) {
+    ocr_roi_t Roi;
+    init_ocr_roi(&Roi, Field->Name, Box, Field->Preprocess, Field->EventType);
+    Roi.Whitelist = "0123456789:.";
+    image_t Image = image_from_cvmat(Frame);
+    return ocr_attempt(Engine, &Image, &Roi, 4.f, 1, Text);
+}
+
+// NOTE: Tesseract with a digit whitelist reads the fields with a glyph that matches none of the templates. Without
+// templates every sample would go to tesseract, so the fields are only read with --digits, or with --capture-digits
+// which needs tesseract to build the templates.
+static void read_battle_fields(state_t* State, cv::Mat* RefFrame) {
+    bool Templates = have_digit_templates(&DigitTemplates);
+    if (!Templates && DigitCaptureDir.empty()) {
+        return;
+    }
+    int FieldCount;
+    const ocr_roi_layout_t* Fields = battle_fields(State->Battle.Battle, &FieldCount);
+    for (int i = 0; i < FieldCount; i++) {
+        if (!Fields[i].Measured) {
+            continue;
+        }
+        std::string Text;
+        int Confidence;
+        rect_t Box = map_rect(&State->Viewport, &Fields[i].Box);
+        if (!Templates || !read_digits(&DigitTemplates, RefFrame, &Box, &Text, &Confidence)) {
+            if (Templates) {
+                count_stat(COUNTER_DIGIT_FALLBACKS);
+            }
+            Confidence = read_digits_tesseract(State->Ocr, RefFrame, Fields + i, Box, &Text);
+            State->OcrFailed = State->OcrFailed || State->Ocr->Failed;
+            if (!DigitCaptureDir.empty() && Confidence >= OCR_CONFIDENCE_THRESHOLD) {
+                capture_digit_glyphs(RefFrame, &Box, Text, State->FrameIndex);
+            }
+        }
+        if (!Text.empty()) {
+            LOGDEBUG("Frame number %d: %s %s (confidence %d)\n", State->FrameIndex, Fields[i].Name, Text.c_str(), Confidence);
+            add_event_at(State, Fields[i].EventType, Text, State->FrameIndex, State->FrameMs, std::max(Confidence, 0));
+        }
+    }
+}
+
+static void init_battle_tracker(battle_tracker_t* Tracker) {
+    Tracker->Battle = BATTLE_NONE;
+    Tracker->Candidate = BATTLE_NONE;
+    Tracker->CandidateFrames = 0;
+    Tracker->FirstFrame = -1;
+    Tracker->FirstMs = 0;
+    Tracker->LastFrame = -1;
+    Tracker->LastMs = 0;
+    Tracker->NextSampleMs = 0;
+}
+
+// NOTE: Backdated events are only emitted if their own frame lies in [BeginFrame, EndFrame)
+static void add_battle_event(state_t* State, const char* Value, int Frame, double Ms, int BeginFrame, int EndFrame) {
+    if (Frame < BeginFrame || (EndFrame >= 0 && Frame >= EndFrame)) {
+        return;
+    }
+    const screen_signature_t* Signature = BattleSignatures + State->Battle.Battle;
+    LOGMSG("Frame number %d: %s %s\n", Frame, Signature->Name, Value);
+    add_event_at(State, Signature->EventType, Value, Frame, Ms);
+    end_of_screen(State);
+}
+
+static void end_battle(state_t* State, int BeginFrame, int EndFrame) {
+    battle_tracker_t* Tracker = &State->Battle;
+    add_battle_event(State, "end", Tracker->LastFrame, Tracker->LastMs, BeginFrame, EndFrame);
+    Tracker->Battle = BATTLE_NONE;
+    Tracker->Candidate = BATTLE_NONE;
+    Tracker->CandidateFrames = 0;
+}
+
+// NOTE: Called for every frame with the battle HUD it shows, BATTLE_NONE for screens and everything else.
+// The timer and score are read on HUD frames at the battle sample rate.
+static void track_battle(state_t* State, cv::Mat* RefFrame, int Hud, int BeginFrame, int EndFrame) {
+    battle_tracker_t* Tracker = &State->Battle;
+    bool Emit = State->FrameIndex >= BeginFrame && (EndFrame < 0 || State->FrameIndex < EndFrame);
+    double SampleRate = State->Options->BattleSampleRate;
+    if (Tracker->Battle != BATTLE_NONE) {
+        if (Hud == Tracker->Battle) {
+            Tracker->LastFrame = State->FrameIndex;
+            Tracker->LastMs = State->FrameMs;
+            if (Emit && SampleRate > 0 && State->FrameMs >= Tracker->NextSampleMs) {
+                Tracker->NextSampleMs = State->FrameMs + 1000.0 / SampleRate;
+                read_battle_fields(State, RefFrame);
+            }
+            return;
+        }
+        if (Hud == BATTLE_NONE && State->FrameIndex - Tracker->LastFrame <= BATTLE_END_GAP_FRAMES) {
+            return;
+        }
+        end_battle(State, BeginFrame, EndFrame);
+    }
+
+    if (Hud == BATTLE_NONE || Hud != Tracker->Candidate) {
+        Tracker->Candidate = Hud;
+        Tracker->CandidateFrames = 0;
+        Tracker->FirstFrame = State->FrameIndex;
+        Tracker->FirstMs = State->FrameMs;
+    }
+    if (Hud != BATTLE_NONE && ++Tracker->CandidateFrames >= BATTLE_START_FRAMES) {
+        Tracker->Battle = Hud;
+        Tracker->LastFrame = State->FrameIndex;
+        Tracker->LastMs = State->FrameMs;
+        Tracker->NextSampleMs = State->FrameMs + (SampleRate > 0 ? 1000.0 / SampleRate : 0);
+        add_battle_event(State, "start", Tracker->FirstFrame, Tracker->FirstMs, BeginFrame, EndFrame);
+        if (Emit && SampleRate > 0) {
+            read_battle_fields(State, RefFrame);
+        }
+    }
+}
+
+// NOTE: A battle whose last HUD frame lies before EndFrame may still end within the gap, so the scan goes on past EndFrame
+static bool battle_end_pending(const state_t* State, int EndFrame) {
+    return State->Battle.Battle != BATTLE_NONE && State->Battle.LastFrame < EndFrame;
+}
+
+// NOTE: Returns false for event types that have no text representation yet
+static bool format_event(const event_t* Event, const char* Value, char* Buffer, size_t BufferSize) {
+    switch (Event->Type) {
+    case EVENT_STIGMATA_SCREEN:
+        snprintf(Buffer, BufferSize, "[STIGMATA_SCREEN]");
+        return true;
+    case EVENT_STIGMATA:
+        snprintf(Buffer, BufferSize, "Stigmata=%s", Value);
+        return true;
+    case EVENT_VALKYRIE_NAME:
+        snprintf(Buffer, BufferSize, "Valkyrie=%s", Value);
+        return true;
+    case EVENT_LINEUP_SCREEN:
+        snprintf(Buffer, BufferSize, "[LINEUP_SCREEN]");
+        return true;
+    case EVENT_WEAPON_SCREEN:
+        snprintf(Buffer, BufferSize, "[WEAPON_SCREEN]");
+        return true;
+    case EVENT_WEAPON:
+        snprintf(Buffer, BufferSize, "Weapon=%s", Value);
+        return true;
+    case EVENT_DIVINE_KEY_SCREEN:
+        snprintf(Buffer, BufferSize, "[DIVINE_KEY_SCREEN]");
+        return true;
+    case EVENT_DIVINE_KEY:
+        snprintf(Buffer, BufferSize, "DivineKey=%s", Value);
+        return true;
+    case EVENT_VALKYRIE_RANK:
+        snprintf(Buffer, BufferSize, "Rank=%s", Value);
+        return true;
+    case EVENT_ELF:
+        snprintf(Buffer, BufferSize, "ELF=%s", Value);
+        return true;
+    case EVENT_ABYSS_BATTLE:
+        snprintf(Buffer, BufferSize, "[ABYSS_BATTLE] %s", Value);
+        return true;
+    case EVENT_ARENA_BATTLE:
+        snprintf(Buffer, BufferSize, "[ARENA_BATTLE] %s", Value);
+        return true;
+    case EVENT_BATTLE_TIMER:
+        snprintf(Buffer, BufferSize, "Timer=%s", Value);
+        return true;
+    case EVENT_BATTLE_SCORE:
+        snprintf(Buffer, BufferSize, "Score=%s", Value);
+        return true;
+    default:
+        LOGDEBUG("Type %d not implemented!\n", Event->Type);
+        return false;
+    }
+}
+
+static const char* event_type_name(event_type_t Type) {
+    switch (Type) {
+    case EVENT_STIGMATA_SCREEN:   return "STIGMATA_SCREEN";
+    case EVENT_WEAPON_SCREEN:     return "WEAPON_SCREEN";
+    case EVENT_DIVINE_KEY_SCREEN: return "DIVINE_KEY_SCREEN";
+    case EVENT_LINEUP_SCREEN:     return "LINEUP_SCREEN";
+    case EVENT_ABYSS_BATTLE:      return "ABYSS_BATTLE";
+    case EVENT_ARENA_BATTLE:      return "ARENA_BATTLE";
+    case EVENT_VALKYRIE_NAME:     return "VALKYRIE_NAME";
+    case EVENT_VALKYRIE_RANK:     return "VALKYRIE_RANK";
+    case EVENT_WEAPON:            return "WEAPON";
+    case EVENT_STIGMATA:          return "STIGMATA";
+    case EVENT_ELF:               return "ELF";
+    case EVENT_DIVINE_KEY:        return "DIVINE_KEY";
+    case EVENT_BATTLE_TIMER:      return "BATTLE_TIMER";
+    case EVENT_BATTLE_SCORE:      return "BATTLE_SCORE";
+    default:                      return "UNKNOWN";
+    }
+}
+
+struct text_cursor_t {
+    char* At;
+    char* End;
+};
+
+static void append_chars(text_cursor_t* Cursor, const char* Str, size_t Length) {
+    Length = std::min(Length, (size_t)(Cursor->End - Cursor->At));
+    memcpy(Cursor->At, Str, Length);
+    Cursor->At += Length;
+}
+
+static void append_str(text_cursor_t* Cursor, const char* Str) {
+    append_chars(Cursor, Str, strlen(Str));
+}
+
+static void append_int(text_cursor_t* Cursor, long long Value) {
+    char Digits[24];
+    int Count = 0;
+    bool Negative = Value < 0;
+    unsigned long long Magnitude = Negative ? 0ull - (unsigned long long)Value : (unsigned long long)Value;
+    do {
+        Digits[sizeof(Digits) - 1 - Count++] = (char)('0' + Magnitude % 10);
+        Magnitude /= 10;
+    } while (Magnitude);
+    if (Negative) {
+        Digits[sizeof(Digits) - 1 - Count++] = '-';
+    }
+    append_chars(Cursor, Digits + sizeof(Digits) - Count, Count);
+}
+
+// NOTE: Escapes quotes, backslashes and control characters, UTF-8 is passed through unchanged.
+// A string that does not fit is cut before the escape or UTF-8 sequence that would overflow, leaving Reserve bytes
+// for what follows it and room for the closing quote, so the line stays valid JSON.
+static void append_json_string(text_cursor_t* Cursor, const char* Str, size_t Reserve = 0) {
+    static const char Hex[] = "0123456789abcdef";
+    text_cursor_t Body = { Cursor->At, Cursor->End - std::min(Reserve + 1, (size_t)(Cursor->End - Cursor->At)) };
+    append_chars(&Body, "\"", 1);
+    for (; *Str; Str++) {
+        unsigned char c = (unsigned char)*Str;
+        char Escaped[6];
+        const char* Chars = Escaped;
+        size_t Length = 1;
+        if (c == '"' || c == '\\') {
+            Escaped[0] = '\\';
+            Escaped[1] = (char)c;
+            Length = 2;
+        }
+        else if (c < 0x20) {
+            memcpy(Escaped, "\\u00", 4);
+            Escaped[4] = Hex[c >> 4];
+            Escaped[5] = Hex[c & 0xf];
+            Length = 6;
+        }
+        else {
+            Chars = Str;
+            while (c >= 0xc0 && ((unsigned char)Str[Length] & 0xc0) == 0x80) {
+                Length++;
+            }
+        }
+        if (Length > (size_t)(Body.End - Body.At)) {
+            break;
+        }
+        append_chars(&Body, Chars, Length);
+        if (Chars == Str) {
+            Str += Length - 1;
+        }
+    }
+    Cursor->At = Body.At;
+    append_chars(Cursor, "\"", 1);
+}
+
+// NOTE: Formats one newline terminated event line, returns 0 for events the format skips
+static size_t format_event_line(output_format_t Format, const event_t* Event, const char* Value, const char* VideoId, char* Buffer, size_t BufferSize) {
+    if (Format == OUTPUT_TEXT) {
+        if (!format_event(Event, Value, Buffer, BufferSize - 1)) {
+            return 0;
+        }
+        size_t Length = strlen(Buffer);
+        Buffer[Length++] = '\n';
+        return Length;
+    }
+
+    text_cursor_t Cursor = { Buffer, Buffer + BufferSize - 2 };
+    append_str(&Cursor, "{\"video\":");
+    append_json_string(&Cursor, VideoId);
+    append_str(&Cursor, ",\"frame\":");
+    append_int(&Cursor, Event->Frame);
+    append_str(&Cursor, ",\"ms\":");
+    append_int(&Cursor, Event->Ms);
+    append_str(&Cursor, ",\"type\":\"");
+    append_str(&Cursor, event_type_name(Event->Type));
+    append_str(&Cursor, "\",\"value\":");
+    // NOTE: Room for the confidence field, an int needs at most 11 characters
+    append_json_string(&Cursor, Value, strlen(",\"confidence\":") + 11);
+    append_str(&Cursor, ",\"confidence\":");
+    append_int(&Cursor, Event->Confidence);
+    // NOTE: The cursor end leaves room for the closing brace and newline even if a value got cut off
+    *Cursor.At++ = '}';
+    *Cursor.At++ = '\n';
+    return Cursor.At - Buffer;
+}
+
+struct recorded_event_t {
+    event_type_t Type;
+    int Frame;
+    int Ms;
+    std::string Value;
+};
+
+// NOTE: Only understands the flat objects format_event_line writes, returns 0 if Key is missing
+static const char* find_json_field(const char* Line, const char* Key) {
+    size_t KeyLength = strlen(Key);
+    for (const char* At = strchr(Line, '"'); At; At = strchr(At + 1, '"')) {
+        if (strncmp(At + 1, Key, KeyLength) == 0 && At[KeyLength + 1] == '"' && At[KeyLength + 2] == ':') {
+            return At + KeyLength + 3;
+        }
+    }
+    return 0;
+}
+
+static bool read_json_string(const char* At, std::string* Value) {
+    Value->clear();
+    if (!At || *At++ != '"') {
+        return false;
+    }
+    for (; *At && *At != '"'; At++) {
+        if (*At != '\\') {
+            Value->push_back(*At);
+            continue;
+        }
+        At++;
+        if (*At == 'u' && isxdigit(At[1]) && isxdigit(At[2]) && isxdigit(At[3]) && isxdigit(At[4])) {
+            char Hex[5] = { At[1], At[2], At[3], At[4], 0 };
+            Value->push_back((char)strtol(Hex, 0, 16));
+            At += 4;
+        }
+        else if (*At == 'n') {
+            Value->push_back('\n');
+        }
+        else if (*At) {
+            Value->push_back(*At);
+        }
+        else {
+            return false;
+        }
+    }
+    return *At == '"';
+}
+
+// NOTE: Reads a line written with --format=jsonl back, the video id and confidence are ignored
+static bool parse_event_line(const char* Line, recorded_event_t* Event) {
+    std::string Type;
+    const char* Frame = find_json_field(Line, "frame");
+    const char* Ms = find_json_field(Line, "ms");
+    if (!Frame || !Ms || !read_json_string(find_json_field(Line, "type"), &Type) || !read_json_string(find_json_field(Line, "value"), &Event->Value)) {
+        return false;
+    }
+    Event->Frame = atoi(Frame);
+    Event->Ms = atoi(Ms);
+    for (int i = 0; i < EVENT_TYPE_COUNT; i++) {
+        if (Type == event_type_name((event_type_t)i)) {
+            Event->Type = (event_type_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool read_events_file(const std::string& Path, std::vector<recorded_event_t>* Events) {
+    FILE* File = fopen(Path.c_str(), "r");
+    if (!File) {
+        return false;
+    }
+    char Line[EVENT_LINE_MAX_BYTES + 2];
+    while (fgets(Line, sizeof(Line), File)) {
+        recorded_event_t Event;
+        if (parse_event_line(Line, &Event)) {
+            Events->push_back(Event);
+        }
+    }
+    fclose(File);
+    return true;
+}
+
+// NOTE: Binary event blocks, all integers little endian. Every block is self-contained and carries its own
+// string table, so block streams from several files can simply be concatenated.
+//   char   Magic[4] = "VAEB"
+//   uint32 Version = 1
+//   uint32 EventCount, StringCount, StringBytes
+//   char   Strings[StringBytes]         StringCount NUL terminated strings, string 0 is ""
+//   int32  Frame[EventCount]
+//   int32  Ms[EventCount]
+//   uint32 Video[EventCount]            string id
+//   uint32 Value[EventCount]            string id
+//   int16  Confidence[EventCount]       -1 if not read by OCR
+//   uint8  Type[EventCount]             event_type_t
+struct event_writer_t {
+    output_format_t Format;
+    FILE* Out;
+    std::string VideoId;
+    char* Buffer;
+    size_t Used;
+    int BlockCount;
+    int32_t* Frames;
+    int32_t* Ms;
+    uint32_t* Videos;
+    uint32_t* Values;
+    int16_t* Confidences;
+    uint8_t* Types;
+    string_table_t Strings;
+};
+
+static void write_event_block(event_writer_t* Writer) {
+    if (Writer->BlockCount == 0) {
+        return;
+    }
+
+    uint32_t Header[5] = {
+        0x42454156, 1, (uint32_t)Writer->BlockCount, (uint32_t)Writer->Strings.Offsets.size(), (uint32_t)Writer->Strings.Chars.size(),
+    };
+    int Count = Writer->BlockCount;
+    TIME_STAGE(STAGE_OUTPUT);
+    count_stat(COUNTER_BYTES_WRITTEN, sizeof(Header) + Writer->Strings.Chars.size() + Count * (3 * sizeof(int32_t) + sizeof(uint32_t) + sizeof(int16_t) + sizeof(uint8_t)));
+    fwrite(Header, sizeof(Header), 1, Writer->Out);
+    fwrite(Writer->Strings.Chars.data(), 1, Writer->Strings.Chars.size(), Writer->Out);
+    fwrite(Writer->Frames, sizeof(int32_t), Count, Writer->Out);
+    fwrite(Writer->Ms, sizeof(int32_t), Count, Writer->Out);
+    fwrite(Writer->Videos, sizeof(uint32_t), Count, Writer->Out);
+    fwrite(Writer->Values, sizeof(uint32_t), Count, Writer->Out);
+    fwrite(Writer->Confidences, sizeof(int16_t), Count, Writer->Out);
+    fwrite(Writer->Types, sizeof(uint8_t), Count, Writer->Out);
+
+    Writer->BlockCount = 0;
+    init_string_table(&Writer->Strings);
+}
+
+static void write_buffered_event(event_sink_t* Sink, const event_t* Event, const char* Value) {
+    event_writer_t* Writer = (event_writer_t*)Sink->User;
+    if (Writer->Format == OUTPUT_BINARY) {
+        if (Writer->BlockCount == EVENT_BLOCK_CAPACITY) {
+            write_event_block(Writer);
+        }
+        int Index = Writer->BlockCount++;
+        Writer->Frames[Index] = Event->Frame;
+        Writer->Ms[Index] = Event->Ms;
+        Writer->Videos[Index] = intern_string(&Writer->Strings, Writer->VideoId);
+        Writer->Values[Index] = intern_string(&Writer->Strings, Value);
+        Writer->Confidences[Index] = (int16_t)Event->Confidence;
+        Writer->Types[Index] = (uint8_t)Event->Type;
+        return;
+    }
+
+    if (EVENT_WRITER_BUFFER_BYTES - Writer->Used < EVENT_LINE_MAX_BYTES) {
+        TIME_STAGE(STAGE_OUTPUT);
+        count_stat(COUNTER_BYTES_WRITTEN, Writer->Used);
+        fwrite(Writer->Buffer, 1, Writer->Used, Writer->Out);
+        Writer->Used = 0;
+    }
+    Writer->Used += format_event_line(Writer->Format, Event, Value, Writer->VideoId.c_str(), Writer->Buffer + Writer->Used, EVENT_LINE_MAX_BYTES);
+}
+
+static void flush_buffered_events(event_sink_t* Sink) {
+    event_writer_t* Writer = (event_writer_t*)Sink->User;
+    write_event_block(Writer);
+    TIME_STAGE(STAGE_OUTPUT);
+    if (Writer->Used) {
+        count_stat(COUNTER_BYTES_WRITTEN, Writer->Used);
+        fwrite(Writer->Buffer, 1, Writer->Used, Writer->Out);
+        Writer->Used = 0;
+    }
+    fflush(Writer->Out);
+}
+
+// NOTE: File = 0 writes to stdout. The writer keeps all of its buffers for the lifetime of the sink,
+// close_event_sink flushes them but leaves closing the file to the caller.
+static void open_event_sink(event_sink_t* Sink, output_format_t Format, FILE* File, const std::string& VideoId) {
+    event_writer_t* Writer = new event_writer_t;
+    Writer->Format = Format;
+    Writer->Out = File ? File : stdout;
+    Writer->VideoId = VideoId;
+    Writer->Used = 0;
+    Writer->BlockCount = 0;
+    Writer->Buffer = 0;
+    Writer->Frames = 0;
+    if (Format == OUTPUT_BINARY) {
+        Writer->Frames = new int32_t[4 * EVENT_BLOCK_CAPACITY];
+        Writer->Ms = Writer->Frames + EVENT_BLOCK_CAPACITY;
+        Writer->Videos = (uint32_t*)(Writer->Frames + 2 * EVENT_BLOCK_CAPACITY);
+        Writer->Values = (uint32_t*)(Writer->Frames + 3 * EVENT_BLOCK_CAPACITY);
+        Writer->Confidences = new int16_t[EVENT_BLOCK_CAPACITY];
+        Writer->Types = new uint8_t[EVENT_BLOCK_CAPACITY];
+        init_string_table(&Writer->Strings);
+#if _WIN32
+        if (!File) {
+            _setmode(_fileno(stdout), _O_BINARY);
+        }
+#endif
+    }
+    else {
+        Writer->Buffer = new char[EVENT_WRITER_BUFFER_BYTES];
+    }
+
+    Sink->Write = write_buffered_event;
+    Sink->Flush = flush_buffered_events;
+    Sink->File = File;
+    Sink->User = Writer;
+    Sink->Next = 0;
+}
+
+static void close_event_sink(event_sink_t* Sink) {
+    event_writer_t* Writer = (event_writer_t*)Sink->User;
+    flush_buffered_events(Sink);
+    if (Writer->Frames) {
+        delete[] Writer->Frames;
+        delete[] Writer->Confidences;
+        delete[] Writer->Types;
+    }
+    delete[] Writer->Buffer;
+    delete Writer;
+    Sink->User = 0;
+}
+
+static const char* output_format_extension(output_format_t Format) {
+    switch (Format) {
+    case OUTPUT_JSONL:  return "jsonl";
+    case OUTPUT_BINARY: return "bin";
+    default:            return "txt";
+    }
+}
+
+#if WITH_SQLITE
+// NOTE: Events are keyed by (video, frame, type, slot), where frame is the frame of the screen appearance and slot
+// counts equal types within it. Inserts replace, so rescans, resumed scans and batch segments never duplicate rows.
+// The (type, value, video_id, frame) index answers "which recordings used stigmata X with valkyrie Y" from the
+// index alone, see the loadouts view.
+static const char* DatabaseSchema =
+    "CREATE TABLE IF NOT EXISTS videos ("
+    "  id INTEGER PRIMARY KEY,"
+    "  path TEXT NOT NULL UNIQUE,"
+    "  name TEXT NOT NULL);"
+    "CREATE TABLE IF NOT EXISTS events ("
+    "  video_id INTEGER NOT NULL REFERENCES videos(id),"
+    "  frame INTEGER NOT NULL,"
+    "  ms INTEGER NOT NULL,"
+    "  type TEXT NOT NULL,"
+    "  slot INTEGER NOT NULL,"
+    "  value TEXT NOT NULL,"
+    "  confidence INTEGER NOT NULL,"
+    "  PRIMARY KEY (video_id, frame, type, slot)) WITHOUT ROWID;"
+    "CREATE INDEX IF NOT EXISTS events_by_value ON events(type, value, video_id, frame);"
+    "CREATE INDEX IF NOT EXISTS events_by_time ON events(video_id, ms);"
+    "CREATE VIEW IF NOT EXISTS loadouts AS"
+    "  SELECT videos.path AS video, valkyrie.frame AS frame, valkyrie.ms AS ms, valkyrie.value AS valkyrie, stigmata.value AS stigmata"
+    "  FROM events AS valkyrie"
+    "  JOIN events AS stigmata ON stigmata.type = 'STIGMATA' AND stigmata.video_id = valkyrie.video_id AND stigmata.frame = valkyrie.frame"
+    "  JOIN videos ON videos.id = valkyrie.video_id"
+    "  WHERE valkyrie.type = 'VALKYRIE_NAME';";
+
+struct database_sink_t {
+    sqlite3* Db;
+    sqlite3_stmt* Insert;
+    sqlite3_int64 VideoId;
+    int PendingRows;
+    int Frame;
+    int Slots[EVENT_TYPE_COUNT];
+};
+
+static bool exec_sql(sqlite3* Db, const char* Sql) {
+    char* Error = 0;
+    if (sqlite3_exec(Db, Sql, 0, 0, &Error) != SQLITE_OK) {
+        LOGERROR("SQLite: %s\n", Error ? Error : sqlite3_errmsg(Db));
+        sqlite3_free(Error);
+        return false;
+    }
+    return true;
+}
+
+static void commit_database_sink(event_sink_t* Sink) {
+    database_sink_t* Database = (database_sink_t*)Sink->User;
+    if (Database->PendingRows) {
+        exec_sql(Database->Db, "COMMIT");
+        Database->PendingRows = 0;
+    }
+}
+
+static void write_database_event(event_sink_t* Sink, const event_t* Event, const char* Value) {
+    database_sink_t* Database = (database_sink_t*)Sink->User;
+    if (Event->Frame != Database->Frame) {
+        Database->Frame = Event->Frame;
+        memset(Database->Slots, 0, sizeof(Database->Slots));
+    }
+    int Slot = Event->Type < EVENT_TYPE_COUNT ? Database->Slots[Event->Type]++ : 0;
+
+    if (Database->PendingRows == 0) {
+        exec_sql(Database->Db, "BEGIN");
+    }
+    sqlite3_stmt* Insert = Database->Insert;
+    sqlite3_bind_int64(Insert, 1, Database->VideoId);
+    sqlite3_bind_int(Insert, 2, Event->Frame);
+    sqlite3_bind_int(Insert, 3, Event->Ms);
+    sqlite3_bind_text(Insert, 4, event_type_name(Event->Type), -1, SQLITE_STATIC);
+    sqlite3_bind_int(Insert, 5, Slot);
+    sqlite3_bind_text(Insert, 6, Value, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(Insert, 7, Event->Confidence);
+    if (sqlite3_step(Insert) != SQLITE_DONE) {
+        LOGERROR("SQLite: %s\n", sqlite3_errmsg(Database->Db));
+    }
+    sqlite3_reset(Insert);
+
+    if (++Database->PendingRows >= SQLITE_BATCH_ROWS) {
+        commit_database_sink(Sink);
+    }
+}
+
+static bool open_database(database_sink_t* Database, const char* Path, const char* SrcFile) {
+    if (sqlite3_open(Path, &Database->Db) != SQLITE_OK) {
+        LOGERROR("SQLite: could not open %s\n", Path);
+        return false;
+    }
+    // NOTE: Batch workers each have their own connection, WAL lets readers continue while one of them commits
+    sqlite3_busy_timeout(Database->Db, 30000);
+    if (!exec_sql(Database->Db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;") || !exec_sql(Database->Db, DatabaseSchema)) {
+        return false;
+    }
+
+    sqlite3_stmt* Statement = 0;
+    std::string Name = std::filesystem::path(SrcFile).stem().string();
+    bool Ok = sqlite3_prepare_v2(Database->Db, "INSERT INTO videos(path, name) VALUES(?1, ?2) ON CONFLICT(path) DO UPDATE SET name = excluded.name RETURNING id", -1, &Statement, 0) == SQLITE_OK;
+    if (Ok) {
+        sqlite3_bind_text(Statement, 1, SrcFile, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(Statement, 2, Name.c_str(), -1, SQLITE_TRANSIENT);
+        Ok = sqlite3_step(Statement) == SQLITE_ROW;
+        if (Ok) {
+            Database->VideoId = sqlite3_column_int64(Statement, 0);
+        }
+    }
+    sqlite3_finalize(Statement);
+
+    Ok = Ok && sqlite3_prepare_v2(Database->Db, "INSERT OR REPLACE INTO events(video_id, frame, ms, type, slot, value, confidence) VALUES(?1, ?2, ?3, ?4, ?5, ?6, ?7)", -1, &Database->Insert, 0) == SQLITE_OK;
+    if (!Ok) {
+        LOGERROR("SQLite: %s\n", sqlite3_errmsg(Database->Db));
+    }
+    return Ok;
+}
+#endif
+
+// NOTE: Returns 0 if no database was requested or it could not be opened, the scan goes on without it
+static event_sink_t* attach_database_sink(const options_t* Options, const char* SrcFile) {
+    if (Options->DatabasePath.empty()) {
+        return 0;
+    }
+#if WITH_SQLITE
+    database_sink_t* Database = new database_sink_t;
+    Database->Db = 0;
+    Database->Insert = 0;
+    Database->PendingRows = 0;
+    Database->Frame = -1;
+    if (!open_database(Database, Options->DatabasePath.c_str(), SrcFile)) {
+        sqlite3_finalize(Database->Insert);
+        sqlite3_close(Database->Db);
+        delete Database;
+        return 0;
+    }
+
+    event_sink_t* Sink = new event_sink_t;
+    Sink->Write = write_database_event;
+    Sink->Flush = commit_database_sink;
+    Sink->File = 0;
+    Sink->User = Database;
+    Sink->Next = 0;
+    return Sink;
+#else
+    (void)SrcFile;
+    LOGWARN("Built without WITH_SQLITE, ignoring sqlite=%s\n", Options->DatabasePath.c_str());
+    return 0;
+#endif
+}
+
+static void detach_database_sink(event_sink_t* Sink) {
+    if (!Sink) {
+        return;
+    }
+#if WITH_SQLITE
+    database_sink_t* Database = (database_sink_t*)Sink->User;
+    commit_database_sink(Sink);
+    sqlite3_finalize(Database->Insert);
+    sqlite3_close(Database->Db);
+    delete Database;
+#endif
+    delete Sink;
+}
+
+struct clip_t {
+    int BeginMs;
+    int EndMs;
+    event_type_t Type;
+};
+
+struct clip_job_t {
+    std::string Ffmpeg;
+    std::string SrcFile;
+    std::string OutPath;
+    clip_t Clip;
+};
+
+// NOTE: One thread runs ffmpeg for the clips of every scanned file, so exports overlap with the next scan.
+// Started on first use, drained and joined at exit.
+struct clip_exporter_t {
+    std::mutex Mutex;
+    std::condition_variable Wake;
+    std::deque<clip_job_t> Jobs;
+    std::thread Thread;
+    bool Stop;
+    std::once_flag Started;
+};
+
+static clip_exporter_t ClipExporter;
+
+#if _WIN32
+// NOTE: Quotes an argument so that CommandLineToArgvW gives it back unchanged, backslashes are only special
+// in front of a quote
+static std::string quote_argument(const std::string& Arg) {
+    std::string Quoted = "\"";
+    int Backslashes = 0;
+    for (char c : Arg) {
+        if (c == '\\') {
+            Backslashes++;
+            continue;
+        }
+        Quoted.append(c == '"' ? 2 * Backslashes + 1 : Backslashes, '\\');
+        Backslashes = 0;
+        Quoted += c;
+    }
+    Quoted.append(2 * Backslashes, '\\');
+    Quoted += '"';
+    return Quoted;
+}
+#endif
+
+// NOTE: Runs Args[0] (looked up in PATH) with the arguments as they are, no shell is involved.
+// Returns the exit status, -1 if the program could not be started or did not exit normally.
+static int run_process(const std::vector<std::string>& Args) {
+#if _WIN32
+    std::string CommandLine;
+    for (const std::string& Arg : Args) {
+        CommandLine += (CommandLine.empty() ? "" : " ") + quote_argument(Arg);
+    }
+    STARTUPINFOA Startup = {};
+    Startup.cb = sizeof(Startup);
+    PROCESS_INFORMATION Process = {};
+    if (!CreateProcessA(0, &CommandLine[0], 0, 0, FALSE, 0, 0, 0, &Startup, &Process)) {
+        return -1;
+    }
+    WaitForSingleObject(Process.hProcess, INFINITE);
+    DWORD ExitCode = (DWORD)-1;
+    GetExitCodeProcess(Process.hProcess, &ExitCode);
+    CloseHandle(Process.hThread);
+    CloseHandle(Process.hProcess);
+    return (int)ExitCode;
+#else
+    std::vector<char*> Argv;
+    for (const std::string& Arg : Args) {
+        Argv.push_back(const_cast<char*>(Arg.c_str()));
+    }
+    Argv.push_back(0);
+    pid_t Pid = fork();
+    if (Pid < 0) {
+        return -1;
+    }
+    if (Pid == 0) {
+        execvp(Argv[0], Argv.data());
+        _exit(127);
+    }
+    int Status;
+    while (waitpid(Pid, &Status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return WIFEXITED(Status) ? WEXITSTATUS(Status) : -1;
+#endif
+}
+
+static void export_clip(const clip_job_t* Job) {
+    TRACE_SCOPE("clip");
+    char Begin[32];
+    char Duration[32];
+    snprintf(Begin, sizeof(Begin), "%.3f", Job->Clip.BeginMs / 1000.0);
+    snprintf(Duration, sizeof(Duration), "%.3f", (Job->Clip.EndMs - Job->Clip.BeginMs) / 1000.0);
+    // NOTE: -ss before -i seeks to the keyframe before the start, -c copy writes the packets as they are
+    std::vector<std::string> Args = { Job->Ffmpeg, "-nostdin", "-v", "error", "-y", "-ss", Begin, "-t", Duration, "-i", Job->SrcFile,
+                                      "-map", "0", "-c", "copy", "-avoid_negative_ts", "make_zero", Job->OutPath };
+    int Status = run_process(Args);
+    if (Status != 0) {
+        LOGWARN("Could not export clip %s (exit status %d)\n", Job->OutPath.c_str(), Status);
+        return;
+    }
+    LOGMSG("Exported clip %s\n", Job->OutPath.c_str());
+}
+
+static void clip_exporter_thread() {
+    for (;;) {
+        clip_job_t Job;
+        {
+            std::unique_lock<std::mutex> Lock(ClipExporter.Mutex);
+            ClipExporter.Wake.wait(Lock, [] { return ClipExporter.Stop || !ClipExporter.Jobs.empty(); });
+            if (ClipExporter.Jobs.empty()) {
+                return;
+            }
+            Job = ClipExporter.Jobs.front();
+            ClipExporter.Jobs.pop_front();
+        }
+        export_clip(&Job);
+    }
+}
+
+static void stop_clip_exporter() {
+    {
+        std::lock_guard<std::mutex> Lock(ClipExporter.Mutex);
+        ClipExporter.Stop = true;
+        ClipExporter.Wake.notify_one();
+    }
+    ClipExporter.Thread.join();
+}
+
+static void start_clip_exporter() {
+    ClipExporter.Stop = false;
+    ClipExporter.Thread = std::thread(clip_exporter_thread);
+    atexit(stop_clip_exporter);
+}
+
+// NOTE: Collects the time ranges of one file while it is scanned, they are queued for export on detach
+struct clip_sink_t {
+    const options_t* Options;
+    std::string SrcFile;
+    std::vector<clip_t> Clips;
+    int BattleBeginMs;
+    event_type_t BattleType;
+};
+
+static void write_clip_event(event_sink_t* Sink, const event_t* Event, const char* Value) {
+    clip_sink_t* Clips = (clip_sink_t*)Sink->User;
+    switch (Event->Type) {
+    case EVENT_STIGMATA_SCREEN:
+    case EVENT_WEAPON_SCREEN:
+    case EVENT_DIVINE_KEY_SCREEN:
+    case EVENT_LINEUP_SCREEN:
+        Clips->Clips.push_back({ Event->Ms - CLIP_LEAD_MS, Event->Ms + CLIP_SCREEN_MS, Event->Type });
+        break;
+    case EVENT_ABYSS_BATTLE:
+    case EVENT_ARENA_BATTLE:
+        // NOTE: Battles cut by a batch segment boundary only get one side, the other one is a screen clip length away
+        if (strcmp(Value, "start") == 0) {
+            Clips->BattleBeginMs = Event->Ms - CLIP_LEAD_MS;
+            Clips->BattleType = Event->Type;
+        }
+        else if (Clips->BattleBeginMs >= 0 && Clips->BattleType == Event->Type) {
+            Clips->Clips.push_back({ Clips->BattleBeginMs, Event->Ms + CLIP_LEAD_MS, Event->Type });
+            Clips->BattleBeginMs = -1;
+        }
+        else {
+            Clips->Clips.push_back({ Event->Ms - CLIP_SCREEN_MS, Event->Ms + CLIP_LEAD_MS, Event->Type });
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// NOTE: Returns Next if clips were not requested, otherwise a sink in front of it
+static event_sink_t* attach_clip_sink(const options_t* Options, const char* SrcFile, event_sink_t* Next) {
+    if (!Options->ExportClips) {
+        return Next;
+    }
+    std::error_code Error;
+    std::filesystem::create_directories(Options->OutputDir + "/clips", Error);
+
+    clip_sink_t* Clips = new clip_sink_t;
+    Clips->Options = Options;
+    Clips->SrcFile = SrcFile;
+    Clips->BattleBeginMs = -1;
+    Clips->BattleType = EVENT_ABYSS_BATTLE;
+
+    event_sink_t* Sink = new event_sink_t;
+    Sink->Write = write_clip_event;
+    Sink->Flush = 0;
+    Sink->File = 0;
+    Sink->User = Clips;
+    Sink->Next = Next;
+    return Sink;
+}
+
+// NOTE: Merges overlapping ranges and queues them on the exporter thread, a battle that has not ended stays pending
+static void queue_clips(clip_sink_t* Clips) {
+    std::sort(Clips->Clips.begin(), Clips->Clips.end(), [](const clip_t& A, const clip_t& B) { return A.BeginMs < B.BeginMs; });
+
+    std::vector<clip_t> Merged;
+    for (size_t i = 0; i < Clips->Clips.size(); i++) {
+        clip_t Clip = Clips->Clips[i];
+        Clip.BeginMs = std::max(Clip.BeginMs, 0);
+        if (!Merged.empty() && Clip.BeginMs <= Merged.back().EndMs) {
+            Merged.back().EndMs = std::max(Merged.back().EndMs, Clip.EndMs);
+        }
+        else {
+            Merged.push_back(Clip);
+        }
+    }
+
+    if (!Merged.empty()) {
+        std::call_once(ClipExporter.Started, start_clip_exporter);
+        std::filesystem::path Src(Clips->SrcFile);
+        std::lock_guard<std::mutex> Lock(ClipExporter.Mutex);
+        for (size_t i = 0; i < Merged.size(); i++) {
+            std::string Type = event_type_name(Merged[i].Type);
+            std::transform(Type.begin(), Type.end(), Type.begin(), [](char c) { return (char)tolower(c); });
+            clip_job_t Job;
+            Job.Ffmpeg = Clips->Options->FfmpegPath;
+            Job.SrcFile = Clips->SrcFile;
+            Job.OutPath = Clips->Options->OutputDir + "/clips/" + Src.stem().string() + "_" + std::to_string(Merged[i].BeginMs) + "_" + Type + Src.extension().string();
+            Job.Clip = Merged[i];
+            ClipExporter.Jobs.push_back(Job);
+        }
+        ClipExporter.Wake.notify_one();
+    }
+    LOGMSG("Queued %d clips of %s\n", (int)Merged.size(), Clips->SrcFile.c_str());
+    Clips->Clips.clear();
+}
+
+static clip_sink_t* find_clip_sink(event_sink_t* Sink) {
+    for (; Sink; Sink = Sink->Next) {
+        if (Sink->Write == write_clip_event) {
+            return (clip_sink_t*)Sink->User;
+        }
+    }
+    return 0;
+}
+
+// NOTE: Called before a checkpoint, the ranges collected so far would be lost if the scan is interrupted after it
+static void flush_clip_sink(event_sink_t* Sink) {
+    clip_sink_t* Clips = find_clip_sink(Sink);
+    if (Clips && !Clips->Clips.empty()) {
+        queue_clips(Clips);
+    }
+}
+
+// NOTE: A battle that was running at the checkpoint ends after the resume, its begin is taken from the tracker
+static void resume_clip_sink(event_sink_t* Sink, const battle_tracker_t* Tracker) {
+    clip_sink_t* Clips = find_clip_sink(Sink);
+    if (Clips && Tracker->Battle != BATTLE_NONE) {
+        Clips->BattleBeginMs = (int)Tracker->FirstMs - CLIP_LEAD_MS;
+        Clips->BattleType = BattleSignatures[Tracker->Battle].EventType;
+    }
+}
+
+// NOTE: Queues the remaining ranges and returns the sink that followed
+static event_sink_t* detach_clip_sink(event_sink_t* Sink) {
+    if (!Sink || Sink->Write != write_clip_event) {
+        return Sink;
+    }
+    clip_sink_t* Clips = (clip_sink_t*)Sink->User;
+    if (Clips->BattleBeginMs >= 0) {
+        Clips->Clips.push_back({ Clips->BattleBeginMs, Clips->BattleBeginMs + CLIP_LEAD_MS + CLIP_SCREEN_MS, Clips->BattleType });
+    }
+    queue_clips(Clips);
+
+    event_sink_t* Next = Sink->Next;
+    delete Clips;
+    delete Sink;
+    return Next;
+}
+
+static void init_options(options_t* Options) {
+    Options->OutputDir = "./Output";
+    Options->DumpFrames = true;
+    Options->ContactSheet = false;
+    Options->CheckpointInterval = 0;
+    Options->Resume = false;
+    Options->FlushMode = FLUSH_SCREEN;
+    Options->Format = OUTPUT_TEXT;
+    Options->BattleSampleRate = BATTLE_DEFAULT_SAMPLE_RATE;
+    Options->ExportClips = false;
+    Options->FfmpegPath = CLIP_FFMPEG;
+    Options->KeyframePass = false;
+}
+
+// NOTE: Shared by the command line (--key=value) and daemon job lines (key=value)
+static bool parse_option(options_t* Options, const char* Key, const char* Value) {
+    if (strcmp(Key, "output") == 0) {
+        Options->OutputDir = Value;
+    }
+    else if (strcmp(Key, "frames") == 0 && strcmp(Value, "sheet") == 0) {
+        Options->DumpFrames = false;
+        Options->ContactSheet = true;
+    }
+    else if (strcmp(Key, "frames") == 0) {
+        Options->DumpFrames = atoi(Value) != 0;
+        Options->ContactSheet = false;
+    }
+    else if (strcmp(Key, "checkpoint") == 0) {
+        Options->CheckpointInterval = atoi(Value);
+    }
+    else if (strcmp(Key, "resume") == 0) {
+        Options->Resume = atoi(Value) != 0;
+    }
+    else if (strcmp(Key, "format") == 0 && strcmp(Value, "text") == 0) {
+        Options->Format = OUTPUT_TEXT;
+    }
+    else if (strcmp(Key, "format") == 0 && strcmp(Value, "jsonl") == 0) {
+        Options->Format = OUTPUT_JSONL;
+    }
+    else if (strcmp(Key, "format") == 0 && strcmp(Value, "binary") == 0) {
+        Options->Format = OUTPUT_BINARY;
+    }
+    else if (strcmp(Key, "battle-rate") == 0) {
+        Options->BattleSampleRate = atof(Value);
+    }
+    else if (strcmp(Key, "events") == 0) {
+        Options->EventsPath = Value;
+    }
+    else if (strcmp(Key, "sqlite") == 0) {
+        Options->DatabasePath = Value;
+    }
+    else if (strcmp(Key, "clips") == 0) {
+        Options->ExportClips = atoi(Value) != 0;
+    }
+    else if (strcmp(Key, "ffmpeg") == 0) {
+        Options->FfmpegPath = Value;
+    }
+    else if (strcmp(Key, "keyframes") == 0) {
+        Options->KeyframePass = atoi(Value) != 0;
+    }
+    else if (strcmp(Key, "flush") == 0 && strcmp(Value, "event") == 0) {
+        Options->FlushMode = FLUSH_EVENT;
+    }
+    else if (strcmp(Key, "flush") == 0 && strcmp(Value, "screen") == 0) {
+        Options->FlushMode = FLUSH_SCREEN;
+    }
+    else if (strcmp(Key, "flush") == 0 && strcmp(Value, "end") == 0) {
+        Options->FlushMode = FLUSH_END;
+    }
+    else {
+        LOGERROR("Unknown option %s=%s\n", Key, Value);
+        return false;
+    }
+    return true;
+}
+
+static void init_state(state_t* State, ocr_engine_t* Ocr, const options_t* Options) {
+    State->Viewport = { 0, 0, REFERENCE_WIDTH, REFERENCE_HEIGHT };
+    State->Calibration.Done = false;
+    State->Calibration.Frames = 0;
+    State->Ocr = Ocr;
+    State->Options = Options;
+    State->Sink = 0;
+    State->Events.First = 0;
+    State->Events.Count = 0;
+    init_string_table(&State->Strings);
+    State->EmittedEvents = 0;
+    State->FrameIndex = 0;
+    State->FrameMs = 0;
+    for (int Screen = 0; Screen < SCREEN_COUNT; Screen++) {
+        State->HadScreenIndicator[Screen] = false;
+        State->DumpIndex[Screen] = 0;
+    }
+    State->Scan.Active = false;
+    init_battle_tracker(&State->Battle);
+    State->Sheet.TileCount = 0;
+    State->Sheet.FirstFrame = 0;
+    for (int Rung = 0; Rung < OCR_RUNG_COUNT; Rung++) {
+        State->OcrRungHistogram[Rung] = 0;
+    }
+    State->OcrFailed = false;
+    State->Cancelled = false;
+    State->Error.clear();
+}
+
+static void write_escaped(FILE* File, const std::string& Value) {
+    for (size_t i = 0; i < Value.size(); i++) {
+        char c = Value[i];
+        switch (c) {
+        case '\\': fputs("\\\\", File); break;
+        case '\n': fputs("\\n", File); break;
+        case '\r': fputs("\\r", File); break;
+        default:   fputc(c, File); break;
+        }
+    }
+}
+
+static std::string read_escaped(const char* Str) {
+    std::string Result;
+    for (; *Str && *Str != '\n'; Str++) {
+        if (Str[0] == '\\' && Str[1]) {
+            Str++;
+            Result += *Str == 'n' ? '\n' : *Str == 'r' ? '\r' : *Str;
+        }
+        else {
+            Result += *Str;
+        }
+    }
+    return Result;
+}
+
+static long long sink_offset(event_sink_t* Sink) {
+    if (!Sink || !Sink->File) {
+        return -1;
+    }
+    fflush(Sink->File);
+#if _WIN32
+    return _ftelli64(Sink->File);
+#else
+    return (long long)ftello(Sink->File);
+#endif
+}
+
+// NOTE: Only written between screen appearances, so the pending OCR ladder state never has to be saved.
+// Buffered events are flushed first, the checkpoint only records how far the sink got. The open contact sheet and
+// the collected clip ranges are written out with them, a resumed scan starts a new sheet and new ranges.
+// The sidecar is written to a temporary file first and renamed over the previous checkpoint.
+static bool write_checkpoint(state_t* State, const char* SrcFile, int NextFrame, bool Done) {
+    flush_events(State, true);
+    write_contact_sheet(State);
+    flush_clip_sink(State->Sink);
+
+    std::string TempPath = State->CheckpointPath + ".tmp";
+    FILE* File = fopen(TempPath.c_str(), "wb");
+    if (!File) {
+        LOGERROR("Could not write checkpoint %s\n", TempPath.c_str());
+        return false;
+    }
+
+    fprintf(File, "void_archives_checkpoint 5\n");
+    fprintf(File, "source ");
+    write_escaped(File, SrcFile);
+    fprintf(File, "\nframe %d\ndone %d\n", NextFrame, Done ? 1 : 0);
+    fprintf(File, "hysteresis");
+    for (int Screen = 0; Screen < SCREEN_COUNT; Screen++) {
+        fprintf(File, " %d", State->HadScreenIndicator[Screen] ? 1 : 0);
+    }
+    fprintf(File, "\ndumps");
+    for (int Screen = 0; Screen < SCREEN_COUNT; Screen++) {
+        fprintf(File, " %d", State->DumpIndex[Screen]);
+    }
+    fprintf(File, "\n");
+    fprintf(File, "histogram");
+    for (int Rung = 0; Rung < OCR_RUNG_COUNT; Rung++) {
+        fprintf(File, " %d", State->OcrRungHistogram[Rung]);
+    }
+    const battle_tracker_t* Tracker = &State->Battle;
+    fprintf(File, "\nbattle %d %d %d %d %d %d %d %d", Tracker->Battle, Tracker->Candidate, Tracker->CandidateFrames,
+            Tracker->FirstFrame, (int)Tracker->FirstMs, Tracker->LastFrame, (int)Tracker->LastMs, (int)Tracker->NextSampleMs);
+    const calibration_t* Calibration = &State->Calibration;
+    const viewport_t* Viewport = &State->Viewport;
+    fprintf(File, "\nviewport %d %d %d %d %d %d %d", Calibration->Done ? 1 : 0, Calibration->FrameWidth, Calibration->FrameHeight,
+            Viewport->X, Viewport->Y, Viewport->Width, Viewport->Height);
+    fprintf(File, "\nemitted %d %lld\n", State->EmittedEvents, sink_offset(State->Sink));
+
+    bool Ok = fflush(File) == 0;
+#if _WIN32
+    Ok = Ok && _commit(_fileno(File)) == 0;
+#else
+    Ok = Ok && fsync(fileno(File)) == 0;
+#endif
+    Ok = (fclose(File) == 0) && Ok;
+
+    std::error_code Error;
+    if (Ok) {
+        std::filesystem::rename(TempPath, State->CheckpointPath, Error);
+    }
+    if (!Ok || Error) {
+        LOGERROR("Could not commit checkpoint %s\n", State->CheckpointPath.c_str());
+        std::filesystem::remove(TempPath, Error);
+        return false;
+    }
+    return true;
+}
+
+// NOTE: Parses "<Name> <v0> <v1> ...", values missing at the end of the line stay untouched
+static bool read_int_list(const char* Line, const char* Name, int* Values, int Count) {
+    size_t NameLength = strlen(Name);
+    if (strncmp(Line, Name, NameLength) != 0) {
+        return false;
+    }
+    char* Ptr = (char*)Line + NameLength;
+    for (int i = 0; i < Count; i++) {
+        char* End;
+        long Value = strtol(Ptr, &End, 10);
+        if (End == Ptr) {
+            break;
+        }
+        Values[i] = (int)Value;
+        Ptr = End;
+    }
+    return true;
+}
+
+static void truncate_sink_file(event_sink_t* Sink, long long Offset) {
+    if (!Sink || !Sink->File) {
+        return;
+    }
+    FILE* SinkFile = Sink->File;
+    fflush(SinkFile);
+#if _WIN32
+    bool Ok = _chsize_s(_fileno(SinkFile), Offset) == 0;
+#else
+    bool Ok = ftruncate(fileno(SinkFile), (off_t)Offset) == 0;
+#endif
+    fseek(SinkFile, 0, SEEK_END);
+    if (!Ok) {
+        LOGERROR("Could not truncate event output to %lld bytes\n", Offset);
+    }
+}
+
+// NOTE: Returns the frame to continue from, or -1 if there is no usable checkpoint for this file.
+// A file sink is truncated back to the checkpoint so that events after it are not written twice,
+// events already sent to stdout or a socket cannot be taken back.
+static int load_checkpoint(state_t* State, const char* SrcFile, bool* Done) {
+    FILE* File = fopen(State->CheckpointPath.c_str(), "rb");
+    if (!File) {
+        return -1;
+    }
+
+    int NextFrame = -1;
+    int Version = 0;
+    int DoneFlag = 0;
+    int HadScreen[SCREEN_COUNT] = {};
+    int DumpIndex[SCREEN_COUNT] = {};
+    int EmittedEvents = 0;
+    long long SinkOffset = -1;
+    int Histogram[OCR_RUNG_COUNT] = {};
+    int Battle[8] = { BATTLE_NONE, BATTLE_NONE, 0, -1, 0, -1, 0, 0 };
+    int Viewport[7] = {};
+    char Line[4096];
+    bool Ok = fgets(Line, sizeof(Line), File) && sscanf(Line, "void_archives_checkpoint %d", &Version) == 1 && Version == 5;
+    Ok = Ok && fgets(Line, sizeof(Line), File) && strncmp(Line, "source ", 7) == 0 && read_escaped(Line + 7) == SrcFile;
+    Ok = Ok && fgets(Line, sizeof(Line), File) && sscanf(Line, "frame %d", &NextFrame) == 1;
+    Ok = Ok && fgets(Line, sizeof(Line), File) && sscanf(Line, "done %d", &DoneFlag) == 1;
+    Ok = Ok && fgets(Line, sizeof(Line), File) && read_int_list(Line, "hysteresis", HadScreen, SCREEN_COUNT);
+    Ok = Ok && fgets(Line, sizeof(Line), File) && read_int_list(Line, "dumps", DumpIndex, SCREEN_COUNT);
+    Ok = Ok && fgets(Line, sizeof(Line), File) && read_int_list(Line, "histogram", Histogram, OCR_RUNG_COUNT);
+    Ok = Ok && fgets(Line, sizeof(Line), File) && read_int_list(Line, "battle", Battle, ARRAY_COUNT(Battle));
+    Ok = Ok && fgets(Line, sizeof(Line), File) && read_int_list(Line, "viewport", Viewport, ARRAY_COUNT(Viewport));
+    Ok = Ok && fgets(Line, sizeof(Line), File) && sscanf(Line, "emitted %d %lld", &EmittedEvents, &SinkOffset) == 2;
+    fclose(File);
+
+    if (!Ok) {
+        LOGWARN("Ignoring unreadable checkpoint %s\n", State->CheckpointPath.c_str());
+        return -1;
+    }
+
+    if (SinkOffset >= 0) {
+        truncate_sink_file(State->Sink, SinkOffset);
+    }
+
+    for (int Screen = 0; Screen < SCREEN_COUNT; Screen++) {
+        State->HadScreenIndicator[Screen] = HadScreen[Screen] != 0;
+        State->DumpIndex[Screen] = DumpIndex[Screen];
+    }
+    State->Battle.Battle = clamp(Battle[0], BATTLE_NONE, BATTLE_COUNT - 1);
+    State->Battle.Candidate = clamp(Battle[1], BATTLE_NONE, BATTLE_COUNT - 1);
+    State->Battle.CandidateFrames = Battle[2];
+    State->Battle.FirstFrame = Battle[3];
+    State->Battle.FirstMs = Battle[4];
+    State->Battle.LastFrame = Battle[5];
+    State->Battle.LastMs = Battle[6];
+    State->Battle.NextSampleMs = Battle[7];
+    resume_clip_sink(State->Sink, &State->Battle);
+    // NOTE: An unfinished calibration starts over with the frames after the checkpoint
+    if (Viewport[0] && Viewport[5] > 0 && Viewport[6] > 0) {
+        State->Calibration.Done = true;
+        State->Calibration.FrameWidth = Viewport[1];
+        State->Calibration.FrameHeight = Viewport[2];
+        State->Viewport = { Viewport[3], Viewport[4], Viewport[5], Viewport[6] };
+    }
+    State->EmittedEvents = EmittedEvents;
+    for (int Rung = 0; Rung < OCR_RUNG_COUNT; Rung++) {
+        State->OcrRungHistogram[Rung] = Histogram[Rung];
+    }
+    *Done = DoneFlag != 0;
+    LOGMSG("Resuming %s from checkpoint at frame %d after %d events\n", SrcFile, NextFrame, EmittedEvents);
+
+    return NextFrame;
+}
+
+static void read_frame(state_t* State, cv::Mat* Frame) {
+    TraceFrame = -1;
+    TraceScreen = 0;
+    TIME_STAGE(STAGE_DECODE);
+    State->Capture >> *Frame;
+    if (!Frame->empty()) {
+        count_stat(COUNTER_FRAMES_DECODED);
+    }
+}
+
+// NOTE: Runs on the first frames of a scan (again if the frame size changes), the whole frame is used until the
+// viewport is known
+static void calibrate_viewport(state_t* State, const cv::Mat& Frame) {
+    calibration_t* Calibration = &State->Calibration;
+    if (Calibration->Done && Frame.cols == Calibration->FrameWidth && Frame.rows == Calibration->FrameHeight) {
+        return;
+    }
+    if (Calibration->Done || Calibration->Frames == 0 || Frame.cols != Calibration->FrameWidth || Frame.rows != Calibration->FrameHeight) {
+        Calibration->Done = false;
+        Calibration->FrameWidth = Frame.cols;
+        Calibration->FrameHeight = Frame.rows;
+        Calibration->Frames = 0;
+        Calibration->ValidFrames = 0;
+        Calibration->RowMax.assign(Frame.rows, 0);
+        Calibration->ColumnMax.assign(Frame.cols, 0);
+        State->Viewport = full_viewport(Frame);
+    }
+
+    for (int y = 0; y < Frame.rows; y++) {
+        const uchar* Pixel = Frame.ptr(y, 0);
+        uchar RowMax = Calibration->RowMax[y];
+        for (int x = 0; x < Frame.cols; x++, Pixel += 3) {
+            uchar Value = std::max(std::max(Pixel[0], Pixel[1]), Pixel[2]);
+            RowMax = std::max(RowMax, Value);
+            Calibration->ColumnMax[x] = std::max(Calibration->ColumnMax[x], Value);
+        }
+        Calibration->RowMax[y] = RowMax;
+    }
+    Calibration->Frames++;
+
+    int Top = 0;
+    int Bottom = Frame.rows;
+    int Left = 0;
+    int Right = Frame.cols;
+    while (Top < Bottom && Calibration->RowMax[Top] < CALIBRATION_BAR_LEVEL) {
+        Top++;
+    }
+    while (Bottom > Top && Calibration->RowMax[Bottom - 1] < CALIBRATION_BAR_LEVEL) {
+        Bottom--;
+    }
+    while (Left < Right && Calibration->ColumnMax[Left] < CALIBRATION_BAR_LEVEL) {
+        Left++;
+    }
+    while (Right > Left && Calibration->ColumnMax[Right - 1] < CALIBRATION_BAR_LEVEL) {
+        Right--;
+    }
+    bool Valid = 2 * (Bottom - Top) >= Frame.rows && 2 * (Right - Left) >= Frame.cols;
+    if (Valid) {
+        Calibration->ValidFrames++;
+    }
+    if (Calibration->ValidFrames < CALIBRATION_FRAMES && Calibration->Frames < CALIBRATION_MAX_FRAMES) {
+        return;
+    }
+
+    Calibration->Done = true;
+    State->Viewport = Valid ? viewport_t{ Left, Top, Right - Left, Bottom - Top } : full_viewport(Frame);
+    Calibration->RowMax = std::vector<uchar>();
+    Calibration->ColumnMax = std::vector<uchar>();
+    LOGMSG("Viewport %dx%d at (%d, %d) of %dx%d after %d frames\n", State->Viewport.Width, State->Viewport.Height,
+           State->Viewport.X, State->Viewport.Y, Frame.cols, Frame.rows, Calibration->Frames);
+}
+
+static bool test_frame(state_t* State, cv::Mat* Frame) {
+    return classify_screen(Frame, &State->Viewport) != SCREEN_NONE || classify_battle(Frame, &State->Viewport) != BATTLE_NONE;
+}
+
+#if WITH_LIBAV
+// NOTE: Relative to the stream start like CAP_PROP_POS_MSEC
+static double keyframe_ms(const AVStream* Stream, int64_t Pts) {
+    int64_t Start = Stream->start_time != AV_NOPTS_VALUE ? Stream->start_time : 0;
+    return (Pts - Start) * av_q2d(Stream->time_base) * 1000.0;
+}
+
+// NOTE: Keyframes are picked by their packet flags before anything is decoded, skip_frame makes the decoder
+// drop whatever non-key frame still gets through. Every keyframe is converted to BGR and tested like a frame
+// of the full pass.
+static void test_decoded_keyframes(state_t* State, AVCodecContext* Decoder, AVFrame* Decoded, SwsContext** Scale, const AVStream* Stream,
+                                   double EndMs, std::vector<keyframe_t>* Keyframes) {
+    for (;;) {
+        {
+            TIME_STAGE(STAGE_DECODE);
+            if (avcodec_receive_frame(Decoder, Decoded) < 0) {
+                return;
+            }
+        }
+        int64_t Pts = Decoded->best_effort_timestamp;
+        if (Pts == AV_NOPTS_VALUE || (!Keyframes->empty() && EndMs >= 0 && Keyframes->back().Ms >= EndMs)) {
+            continue;
+        }
+
+        cv::Mat Frame(Decoded->height, Decoded->width, CV_8UC3);
+        *Scale = sws_getCachedContext(*Scale, Decoded->width, Decoded->height, (AVPixelFormat)Decoded->format,
+                                      Decoded->width, Decoded->height, AV_PIX_FMT_BGR24, SWS_POINT, 0, 0, 0);
+        uint8_t* Planes[1] = { Frame.data };
+        int Strides[1] = { (int)Frame.step };
+        sws_scale(*Scale, Decoded->data, Decoded->linesize, 0, Decoded->height, Planes, Strides);
+
+        count_stat(COUNTER_KEYFRAMES_TESTED);
+        calibrate_viewport(State, Frame);
+        keyframe_t Keyframe;
+        Keyframe.Ms = keyframe_ms(Stream, Pts);
+        Keyframe.Hit = test_frame(State, &Frame);
+        Keyframes->push_back(Keyframe);
+    }
+}
+#endif
+
+// NOTE: Tests the keyframes from the last one at or before FirstFrame to the first one at or after EndFrame. The
+// segment bounds are frame numbers and converted with the average frame rate, the keyframes carry their own times.
+// Returns false if the pass could not run, the full pass then decodes every frame.
+static bool test_keyframes(state_t* State, const char* SrcFile, int FirstFrame, int EndFrame, std::vector<keyframe_t>* Keyframes) {
+#if WITH_LIBAV
+    AVFormatContext* Format = 0;
+    if (avformat_open_input(&Format, SrcFile, 0, 0) < 0) {
+        LOGERROR("Keyframe pass could not open %s\n", SrcFile);
+        return false;
+    }
+    AVCodecContext* Decoder = 0;
+    AVPacket* Packet = av_packet_alloc();
+    AVFrame* Decoded = av_frame_alloc();
+    SwsContext* Scale = 0;
+    int StreamIndex = avformat_find_stream_info(Format, 0) >= 0 ? av_find_best_stream(Format, AVMEDIA_TYPE_VIDEO, -1, -1, 0, 0) : -1;
+    const AVStream* Stream = StreamIndex >= 0 ? Format->streams[StreamIndex] : 0;
+    const AVCodec* Codec = Stream ? avcodec_find_decoder(Stream->codecpar->codec_id) : 0;
+    double Fps = Stream ? av_q2d(Stream->avg_frame_rate) : 0;
+    bool Ok = Codec && Fps > 0 && Packet && Decoded;
+    if (Ok) {
+        Decoder = avcodec_alloc_context3(Codec);
+        Ok = Decoder && avcodec_parameters_to_context(Decoder, Stream->codecpar) >= 0;
+    }
+    if (Ok) {
+        Decoder->skip_frame = AVDISCARD_NONKEY;
+        Ok = avcodec_open2(Decoder, Codec, 0) >= 0;
+    }
+    double EndMs = EndFrame >= 0 && Fps > 0 ? EndFrame * 1000.0 / Fps : -1;
+    if (Ok && FirstFrame > 0) {
+        int64_t Start = Stream->start_time != AV_NOPTS_VALUE ? Stream->start_time : 0;
+        int64_t Timestamp = Start + (int64_t)(FirstFrame / Fps / av_q2d(Stream->time_base));
+        Ok = av_seek_frame(Format, StreamIndex, Timestamp, AVSEEK_FLAG_BACKWARD) >= 0;
+    }
+
+    while (Ok && av_read_frame(Format, Packet) >= 0) {
+        bool Key = Packet->stream_index == StreamIndex && (Packet->flags & AV_PKT_FLAG_KEY);
+        if (Key) {
+            avcodec_send_packet(Decoder, Packet);
+        }
+        av_packet_unref(Packet);
+        if (Key) {
+            test_decoded_keyframes(State, Decoder, Decoded, &Scale, Stream, EndMs, Keyframes);
+            if (EndMs >= 0 && !Keyframes->empty() && Keyframes->back().Ms >= EndMs) {
+                break;
+            }
+        }
+    }
+    if (Ok) {
+        avcodec_send_packet(Decoder, 0);
+        test_decoded_keyframes(State, Decoder, Decoded, &Scale, Stream, EndMs, Keyframes);
+    }
+    else {
+        LOGERROR("Keyframe pass could not decode %s\n", SrcFile);
+    }
+
+    sws_freeContext(Scale);
+    av_frame_free(&Decoded);
+    av_packet_free(&Packet);
+    avcodec_free_context(&Decoder);
+    avformat_close_input(&Format);
+    return Ok;
+#else
+    (void)State;
+    (void)FirstFrame;
+    (void)EndFrame;
+    (void)Keyframes;
+    LOGWARN("Built without WITH_LIBAV, decoding every frame of %s\n", SrcFile);
+    return false;
+#endif
+}
+
+// NOTE: A screen or battle seen on a keyframe may have started right after the keyframe before it and may last
+// until the keyframe after it, so every hit keeps the range between its neighbours
+static void candidate_ranges(const std::vector<keyframe_t>& Keyframes, std::vector<time_range_t>* Ranges) {
+    for (size_t i = 0; i < Keyframes.size(); i++) {
+        if (!Keyframes[i].Hit) {
+            continue;
+        }
+        time_range_t Range;
+        Range.BeginMs = i > 0 ? Keyframes[i - 1].Ms : 0;
+        Range.EndMs = i + 1 < Keyframes.size() ? Keyframes[i + 1].Ms : -1;
+        if (!Ranges->empty() && Ranges->back().EndMs >= 0 && Ranges->back().EndMs >= Range.BeginMs) {
+            Ranges->back().EndMs = Range.EndMs;
+        }
+        else {
+            Ranges->push_back(Range);
+        }
+    }
+}
+
+// NOTE: Scans [BeginFrame, EndFrame), EndFrame < 0 scans to the end of the file.
+// A screen appearance that is still being scanned at EndFrame is finished past it.
+static bool scan_video(state_t* State, const char* SrcFile, int BeginFrame = 0, int EndFrame = -1) {
+    const options_t* Options = State->Options;
+    if (State->CheckpointPath.empty()) {
+        State->CheckpointPath = Options->OutputDir + "/" + std::filesystem::path(SrcFile).stem().string() + ".ckpt";
+    }
+
+    int ResumeFrame = -1;
+    if (Options->Resume) {
+        bool Done = false;
+        ResumeFrame = load_checkpoint(State, SrcFile, &Done);
+        if (Done) {
+            return true;
+        }
+        // NOTE: Without a usable checkpoint the scan starts over, the events an earlier run left in the
+        // output file would be written a second time
+        if (ResumeFrame < 0) {
+            LOGMSG("No checkpoint for %s, scanning from the start\n", SrcFile);
+            truncate_sink_file(State->Sink, 0);
+        }
+    }
+
+    State->Capture.open(SrcFile);
+    if (!State->Capture.isOpened()) {
+        LOGERROR("Could not open file %s\n", SrcFile);
+        State->Error = "Could not open file";
+        return false;
+    }
+
+    LOGMSG("Streaming video file from %s\n", SrcFile);
+
+#if OCR_BACKGROUND_WARMUP
+    warm_ocr_engine(State->Ocr);
+#endif
+
+#if WITH_VIDEO
+    const char* WinName = "Test";
+    cv::namedWindow(WinName, cv::WINDOW_AUTOSIZE);
+    cv::moveWindow(WinName, 0, 0);
+#endif
+
+    LOGMSG("Framerate: %d\nFrame count: %d\n", (int)State->Capture.get(cv::CAP_PROP_FPS), (int)State->Capture.get(cv::CAP_PROP_FRAME_COUNT));
+    for (int Screen = 0; Screen < SCREEN_COUNT; Screen++) {
+        LOGMSG("%s screen threshold confidence value: %.6f\n", ScreenSignatures[Screen].Name, ScreenSignatures[Screen].Threshold);
+    }
+
+    // NOTE: A checkpoint restores the hysteresis state itself, so it needs no preroll
+    if (ResumeFrame > 0) {
+        State->FrameIndex = ResumeFrame;
+        State->Capture.set(cv::CAP_PROP_POS_FRAMES, State->FrameIndex);
+    }
+    else if (BeginFrame > 0) {
+        State->FrameIndex = std::max(BeginFrame - BATCH_SEGMENT_PREROLL_FRAMES, 0);
+        State->Capture.set(cv::CAP_PROP_POS_FRAMES, State->FrameIndex);
+    }
+    int LastCheckpointFrame = State->FrameIndex;
+
+    std::vector<keyframe_t> Keyframes;
+    std::vector<time_range_t> Ranges;
+    bool Filtered = false;
+    if (Options->KeyframePass && test_keyframes(State, SrcFile, State->FrameIndex, EndFrame, &Keyframes)) {
+        candidate_ranges(Keyframes, &Ranges);
+        Filtered = true;
+        LOGMSG("Keyframe pass: %d of %d keyframes in %d ranges\n", (int)std::count_if(Keyframes.begin(), Keyframes.end(), [](const keyframe_t& Keyframe) { return Keyframe.Hit; }),
+               (int)Keyframes.size(), (int)Ranges.size());
+    }
+    size_t NextRange = 0;
+
+    cv::Mat Frame;
+    for (read_frame(State, &Frame); !Frame.empty(); read_frame(State, &Frame), State->FrameIndex++) {
+        if (EndFrame >= 0 && State->FrameIndex >= EndFrame && !State->Scan.Active && !battle_end_pending(State, EndFrame)) {
+            break;
+        }
+
+        State->FrameMs = State->Capture.get(cv::CAP_PROP_POS_MSEC);
+        // NOTE: Outside the candidate ranges frames are only decoded to finish a scan or a battle. After a seek the
+        // frame number is whatever the capture reports, the screen and battle hysteresis starts over like at a
+        // segment start.
+        if (Filtered && !State->Scan.Active && State->Battle.Battle == BATTLE_NONE && State->Battle.Candidate == BATTLE_NONE) {
+            while (NextRange < Ranges.size() && Ranges[NextRange].EndMs >= 0 && Ranges[NextRange].EndMs < State->FrameMs) {
+                NextRange++;
+            }
+            if (NextRange == Ranges.size()) {
+                break;
+            }
+            if (Ranges[NextRange].BeginMs - KEYFRAME_SEEK_PREROLL_MS > State->FrameMs) {
+                int SkippedFrom = State->FrameIndex;
+                State->Capture.set(cv::CAP_PROP_POS_MSEC, Ranges[NextRange].BeginMs - KEYFRAME_SEEK_PREROLL_MS);
+                read_frame(State, &Frame);
+                if (Frame.empty()) {
+                    break;
+                }
+                State->FrameIndex = std::max((int)State->Capture.get(cv::CAP_PROP_POS_FRAMES) - 1, SkippedFrom + 1);
+                State->FrameMs = State->Capture.get(cv::CAP_PROP_POS_MSEC);
+                count_stat(COUNTER_FRAMES_SKIPPED, State->FrameIndex - SkippedFrom - 1);
+                for (int Screen = 0; Screen < SCREEN_COUNT; Screen++) {
+                    State->HadScreenIndicator[Screen] = false;
+                }
+                init_battle_tracker(&State->Battle);
+            }
+        }
+
+        TraceFrame = State->FrameIndex;
+        TRACE_SCOPE("frame");
+        bool Emit = State->FrameIndex >= BeginFrame && (EndFrame < 0 || State->FrameIndex < EndFrame);
+        cv::Mat* RefFrame = &Frame;
+        assert(Frame.isContinuous());
+        if (Frame.isContinuous()) {
+            calibrate_viewport(State, Frame);
+
+            count_stat(COUNTER_FRAMES_TESTED);
+            int Screen = classify_screen(RefFrame, &State->Viewport);
+            if (State->Scan.Active && State->Scan.Screen != Screen) {
+                finish_ocr_scan(State);
+            }
+            for (int Other = 0; Other < SCREEN_COUNT; Other++) {
+                if (Other != Screen) {
+                    State->HadScreenIndicator[Other] = false;
+                }
+            }
+            if (Screen != SCREEN_NONE) {
+                TraceScreen = ScreenSignatures[Screen].Name;
+                if (!State->HadScreenIndicator[Screen]) {
+                    State->HadScreenIndicator[Screen] = true;
+                    count_stat(COUNTER_SCREENS_DETECTED);
+                    if (Emit) {
+                        begin_screen(State, RefFrame, Screen);
+                    }
+                }
+                else {
+                    continue_screen(State, RefFrame, Screen);
+                }
+            }
+            track_battle(State, RefFrame, Screen == SCREEN_NONE ? classify_battle(RefFrame, &State->Viewport) : BATTLE_NONE, BeginFrame, EndFrame);
+        }
+
+        if (Options->CheckpointInterval > 0 && Emit && !State->Scan.Active && State->FrameIndex - LastCheckpointFrame >= Options->CheckpointInterval) {
+            write_checkpoint(State, SrcFile, State->FrameIndex + 1, false);
+            LastCheckpointFrame = State->FrameIndex;
+        }
+        // NOTE: Without tesseract every OCR event would come out empty, a missing or broken traineddata fails the scan
+        if (State->OcrFailed || State->Cancelled) {
+            break;
+        }
+        poll_stats_request();
+#if WITH_VIDEO
+        char c = (char)cv::waitKey(WAIT_DELAY_MS);
+        if (c == 27) break;
+        cv::imshow(WinName, *RefFrame);
+#endif
+    }
+
+    if (State->OcrFailed) {
+        LOGERROR("Stopped scanning %s at frame %d, tesseract is not available\n", SrcFile, State->FrameIndex);
+        State->Error = "Could not initialize tesseract";
+        flush_events(State, true);
+        return false;
+    }
+    if (State->Cancelled) {
+        LOGWARN("Stopped scanning %s at frame %d, %s\n", SrcFile, State->FrameIndex, State->Error.c_str());
+        return false;
+    }
+    finish_ocr_scan(State);
+    if (Frame.empty() && State->Battle.Battle != BATTLE_NONE) {
+        end_battle(State, BeginFrame, EndFrame);
+    }
+    write_contact_sheet(State);
+    log_ocr_histogram(State);
+    if (Options->CheckpointInterval > 0) {
+        write_checkpoint(State, SrcFile, State->FrameIndex, true);
+    }
+    flush_events(State, true);
+
+    return true;
+}
+
+#if _WIN32
+typedef SOCKET socket_t;
+#define INVALID_SOCKET_HANDLE INVALID_SOCKET
+#define close_socket closesocket
+#define poll_sockets WSAPoll
+#else
+typedef int socket_t;
+#define INVALID_SOCKET_HANDLE -1
+#define close_socket close
+#define poll_sockets poll
+#endif
+
+struct daemon_job_t {
+    int Id;
+    socket_t Client;
+    std::string SrcFile;
+    options_t Options;
+};
+
+static bool send_line(socket_t Socket, const char* Line) {
+    std::string Buffer = Line;
+    Buffer += '\n';
+    const char* Ptr = Buffer.c_str();
+    int Remaining = (int)Buffer.size();
+    while (Remaining > 0) {
+        int Sent = (int)send(Socket, Ptr, Remaining, 0);
+        if (Sent <= 0) {
+            return false;
+        }
+        Ptr += Sent;
+        Remaining -= Sent;
+    }
+    return true;
+}
+
+// NOTE: Reads up to and excluding the next newline, returns false if the peer closed the connection first
+// NOTE: A last line without newline counts if the peer closed the connection, not if the receive timed out
+static bool recv_line(socket_t Socket, std::string* Line) {
+    Line->clear();
+    char c;
+    int Received;
+    while ((Received = (int)recv(Socket, &c, 1, 0)) == 1) {
+        if (c == '\n') {
+            return true;
+        }
+        if (c != '\r') {
+            *Line += c;
+        }
+    }
+    return Received == 0 && !Line->empty();
+}
+
+static void set_recv_timeout(socket_t Socket, int Ms) {
+#if _WIN32
+    DWORD Timeout = (DWORD)Ms;
+#else
+    timeval Timeout;
+    Timeout.tv_sec = Ms / 1000;
+    Timeout.tv_usec = (Ms % 1000) * 1000;
+#endif
+    setsockopt(Socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&Timeout, sizeof(Timeout));
+}
+
+// NOTE: The job stream is line based, binary output falls back to text lines
+struct client_stream_t {
+    socket_t Client;
+    output_format_t Format;
+    std::string VideoId;
+    state_t* State;
+};
+
+static void stream_event_to_client(event_sink_t* Sink, const event_t* Event, const char* Value) {
+    client_stream_t* Stream = (client_stream_t*)Sink->User;
+    char Buffer[EVENT_LINE_MAX_BYTES + 1];
+    size_t Length = format_event_line(Stream->Format, Event, Value, Stream->VideoId.c_str(), Buffer, EVENT_LINE_MAX_BYTES);
+    if (Length) {
+        Buffer[Length - 1] = 0;
+        // NOTE: Nobody reads the events of a disconnected client anymore, the scan stops after the current frame
+        if (!Stream->State->Cancelled && !send_line(Stream->Client, Buffer)) {
+            Stream->State->Cancelled = true;
+            Stream->State->Error = "Client disconnected";
+        }
+    }
+}
+
+// NOTE: Events always stream to the client, events=FILE additionally writes them to a file next to the stream
+static void run_daemon_job(ocr_engine_t* Engine, daemon_job_t* Job) {
+    LOGMSG("Job %d: %s\n", Job->Id, Job->SrcFile.c_str());
+    std::error_code Error;
+    std::filesystem::create_directories(Job->Options.OutputDir, Error);
+    FILE* EventsFile = 0;
+    if (!Job->Options.EventsPath.empty()) {
+        std::filesystem::create_directories(std::filesystem::path(Job->Options.EventsPath).parent_path(), Error);
+        EventsFile = fopen(Job->Options.EventsPath.c_str(), Job->Options.Resume ? "ab" : "wb");
+        if (!EventsFile) {
+            LOGERROR("Job %d: could not open %s\n", Job->Id, Job->Options.EventsPath.c_str());
+            send_line(Job->Client, "[ERROR] Could not open the events file");
+            close_socket(Job->Client);
+            return;
+        }
+        fseek(EventsFile, 0, SEEK_END);
+    }
+    begin_job_log(Job->Options.OutputDir + "/log.txt");
+
+    state_t* State = new state_t;
+    init_state(State, Engine, &Job->Options);
+    client_stream_t Stream;
+    Stream.Client = Job->Client;
+    Stream.Format = Job->Options.Format == OUTPUT_JSONL ? OUTPUT_JSONL : OUTPUT_TEXT;
+    Stream.VideoId = std::filesystem::path(Job->SrcFile).stem().string();
+    Stream.State = State;
+    event_sink_t Sink;
+    Sink.Write = stream_event_to_client;
+    Sink.Flush = 0;
+    Sink.File = 0;
+    Sink.User = &Stream;
+    event_sink_t FileSink;
+    event_sink_t* Next = attach_clip_sink(&Job->Options, Job->SrcFile.c_str(), attach_database_sink(&Job->Options, Job->SrcFile.c_str()));
+    if (EventsFile) {
+        open_event_sink(&FileSink, Job->Options.Format, EventsFile, Stream.VideoId);
+        FileSink.Next = Next;
+        Next = &FileSink;
+    }
+    Sink.Next = Next;
+    State->Sink = &Sink;
+    bool Ok = scan_video(State, Job->SrcFile.c_str());
+    if (EventsFile) {
+        Next = FileSink.Next;
+        close_event_sink(&FileSink);
+        fclose(EventsFile);
+    }
+    detach_database_sink(detach_clip_sink(Next));
+    if (Ok) {
+        send_line(Job->Client, "[DONE]");
+    }
+    else {
+        send_line(Job->Client, ("[ERROR] " + State->Error).c_str());
+    }
+    delete State;
+    end_job_log();
+
+    close_socket(Job->Client);
+}
+
+// NOTE: Job line format is "<path>[\t<key>=<value>]*", options not given fall back to the daemon's own
+// NOTE: Paths in job lines are relative to the daemon's output directory and must stay inside it
+// NOTE: "." would be the daemon's output directory itself, shared by every job
+static bool confine_job_path(const std::string& Root, const std::string& Value, std::string* Path) {
+    std::filesystem::path Relative = std::filesystem::path(Value).lexically_normal();
+    if (Relative.empty() || Relative == "." || Relative.has_root_path() || *Relative.begin() == "..") {
+        return false;
+    }
+    *Path = (std::filesystem::path(Root) / Relative).string();
+    return true;
+}
+
+static bool parse_job_line(const std::string& Line, const options_t* Defaults, daemon_job_t* Job) {
+    Job->Options = *Defaults;
+    size_t Start = 0;
+    bool First = true;
+    while (Start <= Line.size()) {
+        size_t End = Line.find('\t', Start);
+        if (End == std::string::npos) {
+            End = Line.size();
+        }
+        std::string Field = Line.substr(Start, End - Start);
+        if (First) {
+            Job->SrcFile = Field;
+            First = false;
+        }
+        else if (!Field.empty()) {
+            size_t Eq = Field.find('=');
+            if (Eq == std::string::npos) {
+                return false;
+            }
+            // NOTE: A client must not pick the program the daemon runs or write outside the daemon's output directory
+            std::string Key = Field.substr(0, Eq);
+            std::string Value = Field.substr(Eq + 1);
+            bool IsPath = Key == "output" || Key == "events" || Key == "sqlite";
+            if (Key == "ffmpeg" || (IsPath && !confine_job_path(Defaults->OutputDir, Value, &Value))) {
+                LOGERROR("Job option %s is not allowed\n", Field.c_str());
+                return false;
+            }
+            if (!parse_option(&Job->Options, Key.c_str(), Value.c_str())) {
+                return false;
+            }
+        }
+        Start = End + 1;
+    }
+    return !Job->SrcFile.empty();
+}
+
+static socket_t open_unix_socket(const char* Path, sockaddr_un* Address) {
+#if _WIN32
+    WSADATA WsaData;
+    WSAStartup(MAKEWORD(2, 2), &WsaData);
+#endif
+    memset(Address, 0, sizeof(*Address));
+    Address->sun_family = AF_UNIX;
+    if (strlen(Path) >= sizeof(Address->sun_path)) {
+        LOGERROR("Socket path %s is too long\n", Path);
+        return INVALID_SOCKET_HANDLE;
+    }
+    strcpy(Address->sun_path, Path);
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+static void serve_daemon_client(ocr_engine_t* Engine, const options_t* Defaults, socket_t Client, int JobId) {
+    std::string Line;
+    daemon_job_t Job;
+    if (!recv_line(Client, &Line) || !parse_job_line(Line, Defaults, &Job)) {
+        send_line(Client, "[ERROR] Malformed job");
+        close_socket(Client);
+        return;
+    }
+    Job.Client = Client;
+    Job.Id = JobId;
+    if (Job.Options.OutputDir == Defaults->OutputDir) {
+        char JobDir[64];
+        snprintf(JobDir, sizeof(JobDir), "/job_%d", Job.Id);
+        Job.Options.OutputDir += JobDir;
+    }
+    run_daemon_job(Engine, &Job);
+}
+
+static int run_daemon(const char* SocketPath, int ThreadCount, const options_t* Defaults) {
+    sockaddr_un Address;
+    socket_t Listener = open_unix_socket(SocketPath, &Address);
+    if (Listener == INVALID_SOCKET_HANDLE) {
+        LOGERROR("Could not create socket\n");
+        return -1;
+    }
+#if !_WIN32
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    remove(SocketPath);
+    bool Ok = bind(Listener, (sockaddr*)&Address, sizeof(Address)) == 0;
+#if !_WIN32
+    // NOTE: Jobs run with the daemon's permissions, only its own user may connect
+    Ok = Ok && chmod(SocketPath, 0600) == 0;
+#endif
+    if (!Ok || listen(Listener, 16) != 0) {
+        LOGERROR("Could not listen on %s\n", SocketPath);
+        close_socket(Listener);
+        return -1;
+    }
+
+    // NOTE: Every worker owns one engine, so engines stay warm across jobs and are never shared between threads
+    ocr_engine_t* Engines = create_ocr_engines(ThreadCount, true);
+    work_pool_t* Pool = new work_pool_t;
+    start_work_pool(Pool, ThreadCount);
+    LOGMSG("Daemon listening on %s with %d workers\n", SocketPath, ThreadCount);
+
+    int NextJobId = 0;
+    for (;;) {
+        // NOTE: Only accepts once a connection is pending, so that an idle daemon still answers a stats request
+        pollfd Pending = {};
+        Pending.fd = Listener;
+        Pending.events = POLLIN;
+        int Ready = poll_sockets(&Pending, 1, STATS_POLL_INTERVAL_MS);
+        poll_stats_request();
+        if (Ready <= 0) {
+            continue;
+        }
+        socket_t Client = accept(Listener, 0, 0);
+        if (Client == INVALID_SOCKET_HANDLE) {
+            continue;
+        }
+
+        // NOTE: The job line is read by the worker, a client that never sends one only holds up that worker
+        // until the timeout and never the accept loop
+        set_recv_timeout(Client, DAEMON_RECV_TIMEOUT_MS);
+        int JobId = NextJobId++;
+        submit_work(Pool, -1, [Engines, Defaults, Client, JobId](int WorkerIndex) {
+            serve_daemon_client(Engines + WorkerIndex, Defaults, Client, JobId);
+        });
+    }
+}
+
+// NOTE: Minimal client for testing the daemon, prints the streamed event lines to stdout
+static int run_client(const char* SocketPath, const char* SrcFile, const std::vector<std::string>& JobOptions) {
+    sockaddr_un Address;
+    socket_t Socket = open_unix_socket(SocketPath, &Address);
+    if (Socket == INVALID_SOCKET_HANDLE || connect(Socket, (sockaddr*)&Address, sizeof(Address)) != 0) {
+        fprintf(stderr, "Could not connect to %s\n", SocketPath);
+        return -1;
+    }
+
+    std::string Job = SrcFile;
+    for (size_t i = 0; i < JobOptions.size(); i++) {
+        Job += '\t';
+        Job += JobOptions[i];
+    }
+    send_line(Socket, Job.c_str());
+
+    int Result = -1;
+    std::string Line;
+    while (recv_line(Socket, &Line)) {
+        if (Line == "[DONE]") {
+            Result = 0;
+            break;
+        }
+        OUTPUT("%s", Line.c_str());
+    }
+    close_socket(Socket);
+
+    return Result;
+}
+
+struct batch_file_t {
+    std::string SrcFile;
+    options_t Options;
+    int SegmentCount;
+    std::atomic<int> EventCount;
+    std::atomic<int> PendingSegments;
+    std::mutex Mutex;
+    std::string Error;
+};
+
+struct batch_t {
+    work_pool_t Pool;
+    ocr_engine_t* Engines;
+    std::vector<batch_file_t*> Files;
+    std::atomic<int> FailedFiles;
+};
+
+static bool is_video_file(const std::filesystem::path& Path) {
+    const char* Extensions[] = { ".mp4", ".mkv", ".avi", ".mov", ".webm", ".flv", ".m4v", ".ts" };
+    std::string Extension = Path.extension().string();
+    for (size_t i = 0; i < Extension.size(); i++) {
+        Extension[i] = (char)tolower(Extension[i]);
+    }
+    for (int i = 0; i < (int)ARRAY_COUNT(Extensions); i++) {
+        if (Extension == Extensions[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void collect_batch_inputs(const std::vector<std::string>& Inputs, std::vector<std::string>* Files) {
+    for (size_t i = 0; i < Inputs.size(); i++) {
+        std::error_code Error;
+        if (!std::filesystem::is_directory(Inputs[i], Error)) {
+            Files->push_back(Inputs[i]);
+            continue;
+        }
+
+        std::vector<std::string> DirFiles;
+        std::filesystem::recursive_directory_iterator It(Inputs[i], std::filesystem::directory_options::skip_permission_denied, Error);
+        for (; !Error && It != std::filesystem::recursive_directory_iterator(); It.increment(Error)) {
+            if (It->is_regular_file(Error) && is_video_file(It->path())) {
+                DirFiles.push_back(It->path().string());
+            }
+        }
+        if (Error) {
+            LOGERROR("Could not list %s: %s\n", Inputs[i].c_str(), Error.message().c_str());
+        }
+        std::sort(DirFiles.begin(), DirFiles.end());
+        Files->insert(Files->end(), DirFiles.begin(), DirFiles.end());
+    }
+}
+
+static std::string segment_events_path(const batch_file_t* File, int Segment) {
+    return File->Options.OutputDir + "/segment_" + std::to_string(Segment) + ".events";
+}
+
+// NOTE: Every segment streams into its own file, they are concatenated in order once the last one is done.
+// events.<format> is renamed into place, so its existence marks a finished file for --resume. The segment
+// files and checkpoints are only kept around if something failed.
+static void finish_batch_file(batch_t* Batch, batch_file_t* File) {
+    std::string EventsPath = File->Options.OutputDir + "/events." + output_format_extension(File->Options.Format);
+    std::string TempPath = EventsPath + ".tmp";
+    FILE* Out = fopen(TempPath.c_str(), "wb");
+    bool Ok = Out != 0;
+    char Buffer[64 * 1024];
+    for (int Segment = 0; Ok && Segment < File->SegmentCount; Segment++) {
+        FILE* In = fopen(segment_events_path(File, Segment).c_str(), "rb");
+        if (!In) {
+            continue;
+        }
+        size_t Bytes;
+        while ((Bytes = fread(Buffer, 1, sizeof(Buffer), In)) > 0) {
+            Ok = Ok && fwrite(Buffer, 1, Bytes, Out) == Bytes;
+        }
+        fclose(In);
+    }
+    if (Out) {
+        Ok = (fclose(Out) == 0) && Ok;
+    }
+
+    std::error_code FsError;
+    if (Ok) {
+        std::filesystem::rename(TempPath, EventsPath, FsError);
+    }
+    if ((!Ok || FsError) && File->Error.empty()) {
+        File->Error = "Could not write " + EventsPath;
+    }
+    if (File->Error.empty()) {
+        for (int Segment = 0; Segment < File->SegmentCount; Segment++) {
+            std::filesystem::remove(segment_events_path(File, Segment), FsError);
+            std::filesystem::remove(File->Options.OutputDir + "/segment_" + std::to_string(Segment) + ".ckpt", FsError);
+        }
+        std::filesystem::remove(File->Options.OutputDir + "/error.txt", FsError);
+    }
+
+    int EventCount = File->EventCount;
+
+    if (!File->Error.empty()) {
+        std::string ErrorPath = File->Options.OutputDir + "/error.txt";
+        FILE* ErrorFile = fopen(ErrorPath.c_str(), "w");
+        if (ErrorFile) {
+            fprintf(ErrorFile, "%s\n", File->Error.c_str());
+            fclose(ErrorFile);
+        }
+        Batch->FailedFiles++;
+        OUTPUT("[FAILED] %s: %s", File->SrcFile.c_str(), File->Error.c_str());
+    }
+    else {
+        OUTPUT("[OK] %s: %d events", File->SrcFile.c_str(), EventCount);
+    }
+}
+
+// NOTE: Exceptions thrown by OpenCV only fail the current file, the rest of the batch keeps going
+static void scan_batch_segment(batch_t* Batch, batch_file_t* File, int Segment, int BeginFrame, int EndFrame, int WorkerIndex) {
+    state_t* State = new state_t;
+    init_state(State, Batch->Engines + WorkerIndex, &File->Options);
+    // NOTE: Seeding the dump counters with the segment start keeps the frame dumps of all segments apart
+    for (int Screen = 0; Screen < SCREEN_COUNT; Screen++) {
+        State->DumpIndex[Screen] = BeginFrame;
+    }
+    State->CheckpointPath = File->Options.OutputDir + "/segment_" + std::to_string(Segment) + ".ckpt";
+    begin_job_log(File->Options.OutputDir + (File->SegmentCount > 1 ? "/log_" + std::to_string(Segment) + ".txt" : "/log.txt"));
+
+    std::string Error;
+    std::string EventsPath = segment_events_path(File, Segment);
+    FILE* EventsFile = fopen(EventsPath.c_str(), File->Options.Resume ? "ab" : "wb");
+    if (!EventsFile) {
+        Error = "Could not write " + EventsPath;
+    }
+    else {
+        fseek(EventsFile, 0, SEEK_END);
+        event_sink_t Sink;
+        open_event_sink(&Sink, File->Options.Format, EventsFile, std::filesystem::path(File->SrcFile).stem().string());
+        Sink.Next = attach_clip_sink(&File->Options, File->SrcFile.c_str(), attach_database_sink(&File->Options, File->SrcFile.c_str()));
+        State->Sink = &Sink;
+        try {
+            if (!scan_video(State, File->SrcFile.c_str(), BeginFrame, EndFrame)) {
+                Error = State->Error;
+            }
+        }
+        catch (const std::exception& Exception) {
+            Error = Exception.what();
+        }
+        flush_events(State, false);
+        detach_database_sink(detach_clip_sink(Sink.Next));
+        close_event_sink(&Sink);
+        fclose(EventsFile);
+    }
+    File->EventCount += State->EmittedEvents;
+
+    if (!Error.empty()) {
+        std::lock_guard<std::mutex> Lock(File->Mutex);
+        if (File->Error.empty()) {
+            File->Error = Error;
+        }
+    }
+    delete State;
+    end_job_log();
+
+    if (--File->PendingSegments == 0) {
+        finish_batch_file(Batch, File);
+    }
+}
+
+// NOTE: Segments are pushed onto the planning worker's own queue, idle workers steal them from there
+static void plan_batch_file(batch_t* Batch, batch_file_t* File, int WorkerIndex) {
+    int FrameCount = 0;
+    try {
+        cv::VideoCapture Capture(File->SrcFile);
+        if (Capture.isOpened()) {
+            FrameCount = (int)Capture.get(cv::CAP_PROP_FRAME_COUNT);
+        }
+    }
+    catch (const std::exception&) {
+    }
+
+    int SegmentCount = FrameCount > 0 ? (FrameCount + BATCH_SEGMENT_FRAMES - 1) / BATCH_SEGMENT_FRAMES : 1;
+    File->SegmentCount = SegmentCount;
+    File->PendingSegments = SegmentCount;
+    LOGMSG("Batch: %s has %d frames, %d segments\n", File->SrcFile.c_str(), FrameCount, SegmentCount);
+
+    for (int Segment = 1; Segment < SegmentCount; Segment++) {
+        int BeginFrame = Segment * BATCH_SEGMENT_FRAMES;
+        int EndFrame = Segment + 1 < SegmentCount ? BeginFrame + BATCH_SEGMENT_FRAMES : -1;
+        submit_work(&Batch->Pool, WorkerIndex, [Batch, File, Segment, BeginFrame, EndFrame](int Worker) {
+            scan_batch_segment(Batch, File, Segment, BeginFrame, EndFrame, Worker);
+        });
+    }
+    scan_batch_segment(Batch, File, 0, 0, SegmentCount > 1 ? BATCH_SEGMENT_FRAMES : -1, WorkerIndex);
+}
+
+static void scan_batch_pack(batch_t* Batch, const std::vector<batch_file_t*>& Pack, int WorkerIndex) {
+    for (size_t i = 0; i < Pack.size(); i++) {
+        batch_file_t* File = Pack[i];
+        File->SegmentCount = 1;
+        File->PendingSegments = 1;
+        scan_batch_segment(Batch, File, 0, 0, -1, WorkerIndex);
+    }
+}
+
+// NOTE: Large files are split into segments, small files are packed together so that each task
+// amortizes the scheduling and engine overhead. Every file gets its own directory under the output.
+static int run_batch(const std::vector<std::string>& Inputs, int ThreadCount, const options_t* Defaults) {
+    std::vector<std::string> SrcFiles;
+    collect_batch_inputs(Inputs, &SrcFiles);
+    if (SrcFiles.empty()) {
+        LOGMSG("Batch: no input files\n");
+        return 0;
+    }
+
+    batch_t* Batch = new batch_t;
+    Batch->Engines = create_ocr_engines(ThreadCount, false);
+    Batch->FailedFiles = 0;
+    start_work_pool(&Batch->Pool, ThreadCount);
+
+    std::set<std::string> UsedNames;
+    std::vector<batch_file_t*> Pack;
+    unsigned long long PackBytes = 0;
+    for (size_t i = 0; i < SrcFiles.size(); i++) {
+        batch_file_t* File = new batch_file_t;
+        File->SrcFile = SrcFiles[i];
+        File->Options = *Defaults;
+        File->EventCount = 0;
+
+        std::string Name = std::filesystem::path(SrcFiles[i]).stem().string();
+        std::string UniqueName = Name;
+        for (int Suffix = 1; UsedNames.count(UniqueName); Suffix++) {
+            UniqueName = Name + "_" + std::to_string(Suffix);
+        }
+        UsedNames.insert(UniqueName);
+        File->Options.OutputDir = Defaults->OutputDir + "/" + UniqueName;
+        std::error_code Error;
+        std::filesystem::create_directories(File->Options.OutputDir, Error);
+        Batch->Files.push_back(File);
+
+        std::string EventsPath = File->Options.OutputDir + "/events." + output_format_extension(File->Options.Format);
+        if (Defaults->Resume && std::filesystem::exists(EventsPath, Error) && !std::filesystem::exists(File->Options.OutputDir + "/error.txt", Error)) {
+            OUTPUT("[OK] %s: already done", File->SrcFile.c_str());
+            continue;
+        }
+
+        unsigned long long Bytes = std::filesystem::file_size(SrcFiles[i], Error);
+        if (Error || Bytes >= BATCH_SMALL_FILE_BYTES) {
+            submit_work(&Batch->Pool, -1, [Batch, File](int Worker) {
+                plan_batch_file(Batch, File, Worker);
+            });
+            continue;
+        }
+
+        Pack.push_back(File);
+        PackBytes += Bytes;
+        if (PackBytes >= BATCH_PACK_BYTES) {
+            submit_work(&Batch->Pool, -1, [Batch, Pack](int Worker) {
+                scan_batch_pack(Batch, Pack, Worker);
+            });
+            Pack.clear();
+            PackBytes = 0;
+        }
+    }
+    if (!Pack.empty()) {
+        submit_work(&Batch->Pool, -1, [Batch, Pack](int Worker) {
+            scan_batch_pack(Batch, Pack, Worker);
+        });
+    }
+
+    // NOTE: Workers poll between frames, this covers planning, OCR and the last file's tail
+    while (!wait_work_pool_for(&Batch->Pool, STATS_POLL_INTERVAL_MS)) {
+        poll_stats_request();
+    }
+    stop_work_pool(&Batch->Pool);
+
+    int FailedFiles = Batch->FailedFiles;
+    for (size_t i = 0; i < Batch->Files.size(); i++) {
+        delete Batch->Files[i];
+    }
+    delete[] Batch->Engines;
+    delete Batch;
+
+    OUTPUT("Batch: %d files, %d failed", (int)SrcFiles.size(), FailedFiles);
+    LOGMSG("Batch: %d files, %d failed\n", (int)SrcFiles.size(), FailedFiles);
+
+    return FailedFiles ? 1 : 0;
+}
+
+// NOTE: Paints the indicator pixels of a screen into a frame, with a small margin so that resizing keeps them
+static void draw_screen_indicators(cv::Mat* Frame, const screen_signature_t* Signature) {
+    for (int i = 0; i < Signature->PixelCount; i++) {
+        const test_pixel_t* TestPixel = Signature->Pixels + i;
+        cv::Scalar Color(TestPixel->Color[2], TestPixel->Color[1], TestPixel->Color[0]);
+        cv::rectangle(*Frame, cv::Rect(TestPixel->x - 2, TestPixel->y - 2, 5, 5), Color, cv::FILLED);
+    }
+}
+
+// NOTE: Kernel results are stored here so that the compiler can't drop the kernels, the value itself is meaningless
+static volatile int BenchSink;
+
+static void run_benchmark(const char* Name, const char* FrameName, int64_t Pixels, const std::function<void()>& Kernel) {
+    for (uint64_t Iterations = 1;; Iterations *= 2) {
+        uint64_t BeginNs = stats_now_ns();
+        for (uint64_t i = 0; i < Iterations; i++) {
+            Kernel();
+        }
+        uint64_t Ns = stats_now_ns() - BeginNs;
+        if (Ns >= BENCH_MIN_NS) {
+            double NsPerOp = (double)Ns / Iterations;
+            OUTPUT("%-24s %-12s %12.1f ns/op %9.3f ns/px %12.1f op/s", Name, FrameName, NsPerOp, Pixels ? NsPerOp / Pixels : 0.0, 1e9 / NsPerOp);
+            return;
+        }
+    }
 }
 
-static void output_events(const state_t *State) {
-    for (auto it = State->Events.begin(); it != State->Events.end(); it++) {
-        const event_t& Event = *it;
-        const char* Value = Event.Value.c_str();
-        switch (Event.Type) {
-        case EVENT_STIGMATA_SCREEN:
-            OUTPUT("[STIGMATA_SCREEN]");
-            break;
-        case EVENT_STIGMATA:
-            OUTPUT("Stigmata=%s", Value);
-            break;
-        case EVENT_VALKYRIE_NAME:
-            OUTPUT("Valkyrie=%s", Value);
-            break;
-        case EVENT_LINEUP_SCREEN:
-            OUTPUT("[LINEUP_SCREEN]");
+static void bench_frame(const char* FrameName, const cv::Mat& Source, ocr_engine_t* Engine) {
+    const int64_t FramePixels = (int64_t)Source.cols * Source.rows;
+    cv::Mat Frame = Source.clone();
+    const viewport_t Viewport = full_viewport(Frame);
+    const rect_t DigitBox = map_rect(&Viewport, &AbyssFields[0].Box);
+    image_t Image = image_from_cvmat(&Frame);
+    const rect_t StigmataBox = map_rect(&Viewport, &StigmataRois[1].Box);
+    const int64_t BoxPixels = (int64_t)StigmataBox.Width * StigmataBox.Height;
+
+    for (int Screen = 0; Screen < SCREEN_COUNT; Screen++) {
+        const screen_signature_t* Signature = ScreenSignatures + Screen;
+        std::string Name = std::string("screen_test ") + Signature->Name;
+        run_benchmark(Name.c_str(), FrameName, Signature->PixelCount, [&] {
+            BenchSink = BenchSink + screen_test(&Frame, &Viewport, Signature->Pixels, Signature->PixelCount, Signature->Threshold);
+        });
+    }
+    run_benchmark("classify_screen", FrameName, 0, [&] {
+        BenchSink = BenchSink + classify_screen(&Frame, &Viewport);
+    });
+    run_benchmark("classify_battle", FrameName, 0, [&] {
+        BenchSink = BenchSink + classify_battle(&Frame, &Viewport);
+    });
+    // NOTE: On a captured battle frame both readers have to agree, the template path is only worth it if it does
+    if (have_digit_templates(&DigitTemplates)) {
+        std::string Text;
+        int Confidence;
+        bool Read = read_digits(&DigitTemplates, &Frame, &DigitBox, &Text, &Confidence);
+        LOGMSG("%s: read_digits %s \"%s\" (confidence %d)\n", FrameName, Read ? "read" : "rejected", Text.c_str(), Confidence);
+        run_benchmark("read_digits", FrameName, DigitBox.Width * DigitBox.Height, [&] {
+            BenchSink = BenchSink + read_digits(&DigitTemplates, &Frame, &DigitBox, &Text, &Confidence);
+        });
+    }
+    if (acquire_tess(Engine)) {
+        std::string Text;
+        int Confidence = read_digits_tesseract(Engine, &Frame, AbyssFields, DigitBox, &Text);
+        LOGMSG("%s: tesseract digits \"%s\" (confidence %d)\n", FrameName, Text.c_str(), Confidence);
+        run_benchmark("read_digits tesseract", FrameName, DigitBox.Width * DigitBox.Height, [&] {
+            BenchSink = BenchSink + read_digits_tesseract(Engine, &Frame, AbyssFields, DigitBox, &Text);
+        });
+    }
+    run_benchmark("invert_image", FrameName, FramePixels, [&] { invert_image(&Image); });
+    run_benchmark("change_contrast", FrameName, FramePixels, [&] { change_contrast(&Image, 4.f); });
+    run_benchmark("to_grayscale", FrameName, FramePixels, [&] { to_grayscale(&Image); });
+
+    cv::Mat Scratch;
+    run_benchmark("subimage copy", FrameName, BoxPixels, [&] {
+        image_t Src = subimage(&Image, &StigmataBox);
+        cv::Mat SrcMat(Src.Height, Src.Width, CV_8UC3, Src.Pixels, Src.Pitch);
+        SrcMat.copyTo(Scratch);
+    });
+    run_benchmark("subimage upscale", FrameName, BoxPixels, [&] {
+        image_t Src = subimage(&Image, &StigmataBox);
+        cv::Mat SrcMat(Src.Height, Src.Width, CV_8UC3, Src.Pixels, Src.Pitch);
+        cv::resize(SrcMat, Scratch, cv::Size(OCR_UPSCALE_FACTOR * Src.Width, OCR_UPSCALE_FACTOR * Src.Height), 0, 0, cv::INTER_CUBIC);
+    });
+
+    // NOTE: Typical GetUTF8Text output for a stigmata box
+    const char OcrText[] = "  Tesla: Bolt\nThrower (T)\n\n";
+    run_benchmark("replace_char + trim", FrameName, 0, [&] {
+        char Text[sizeof(OcrText)];
+        memcpy(Text, OcrText, sizeof(OcrText));
+        BenchSink = BenchSink + (int)trim(replace_char(Text, '\n', ' ')).size();
+    });
+
+    // NOTE: The full path restores the frame every time, the kernels above modified it in place
+    options_t Options;
+    init_options(&Options);
+    Options.DumpFrames = false;
+    state_t* State = new state_t;
+    init_state(State, Engine, &Options);
+    // NOTE: Set like a calibrated scan would, so that the ROIs are mapped into this frame's game area
+    State->Viewport = Viewport;
+    run_benchmark("scan stigmata screen", FrameName, FramePixels, [&] {
+        Source.copyTo(Frame);
+        begin_screen(State, &Frame, SCREEN_STIGMATA);
+        finish_ocr_scan(State);
+        flush_events(State, false);
+    });
+    delete State;
+}
+
+// NOTE: Collects the events of a scan in memory for scoring
+static void collect_event(event_sink_t* Sink, const event_t* Event, const char* Value) {
+    std::vector<recorded_event_t>* Events = (std::vector<recorded_event_t>*)Sink->User;
+    recorded_event_t Recorded = { Event->Type, Event->Frame, Event->Ms, Value };
+    Events->push_back(Recorded);
+}
+
+// NOTE: 1 - Levenshtein distance / longer length, compared case-insensitively
+static double text_similarity(const std::string& A, const std::string& B) {
+    if (A.empty() && B.empty()) {
+        return 1.0;
+    }
+    std::vector<int> Row(B.size() + 1);
+    for (size_t j = 0; j <= B.size(); j++) {
+        Row[j] = (int)j;
+    }
+    for (size_t i = 1; i <= A.size(); i++) {
+        int Diagonal = Row[0];
+        Row[0] = (int)i;
+        for (size_t j = 1; j <= B.size(); j++) {
+            int Above = Row[j];
+            int Substitute = Diagonal + (tolower((unsigned char)A[i - 1]) != tolower((unsigned char)B[j - 1]));
+            Row[j] = std::min(std::min(Row[j - 1] + 1, Above + 1), Substitute);
+            Diagonal = Above;
+        }
+    }
+    return 1.0 - (double)Row[B.size()] / std::max(A.size(), B.size());
+}
+
+struct event_score_t {
+    int Expected;
+    int Produced;
+    int Matched;
+};
+
+// NOTE: Greedy, every expected event takes the closest unmatched produced event that matches it
+static event_score_t score_events(const std::vector<recorded_event_t>& Expected, const std::vector<recorded_event_t>& Produced, int FrameTolerance, double MinSimilarity) {
+    event_score_t Score = { (int)Expected.size(), (int)Produced.size(), 0 };
+    std::vector<bool> Used(Produced.size());
+    for (size_t e = 0; e < Expected.size(); e++) {
+        int Best = -1;
+        for (size_t p = 0; p < Produced.size(); p++) {
+            int Distance = abs(Produced[p].Frame - Expected[e].Frame);
+            if (Used[p] || Produced[p].Type != Expected[e].Type || Distance > FrameTolerance || text_similarity(Expected[e].Value, Produced[p].Value) < MinSimilarity) {
+                continue;
+            }
+            if (Best < 0 || Distance < abs(Produced[Best].Frame - Expected[e].Frame)) {
+                Best = (int)p;
+            }
+        }
+        if (Best >= 0) {
+            Used[Best] = true;
+            Score.Matched++;
+        }
+    }
+    return Score;
+}
+
+static double precision(const event_score_t* Score) {
+    return Score->Produced ? (double)Score->Matched / Score->Produced : 1.0;
+}
+
+static double recall(const event_score_t* Score) {
+    return Score->Expected ? (double)Score->Matched / Score->Expected : 1.0;
+}
+
+// NOTE: <name>.expected.jsonl next to a video holds the events it should produce, as written by --generate
+static std::string expected_events_path(const std::string& SrcFile) {
+    std::filesystem::path Path(SrcFile);
+    return (Path.parent_path() / (Path.stem().string() + ".expected.jsonl")).string();
+}
+
+// NOTE: Scans a whole video into memory, returns the number of frames or -1 with the reason in Error if the scan failed
+static int scan_video_events(ocr_engine_t* Engine, const options_t* Options, const std::string& SrcFile, std::vector<recorded_event_t>* Events, double* Seconds, std::string* Error) {
+    state_t* State = new state_t;
+    init_state(State, Engine, Options);
+    event_sink_t Sink;
+    Sink.Write = collect_event;
+    Sink.Flush = 0;
+    Sink.File = 0;
+    Sink.User = Events;
+    Sink.Next = 0;
+    State->Sink = &Sink;
+
+    uint64_t BeginNs = stats_now_ns();
+    bool Ok = scan_video(State, SrcFile.c_str());
+    *Seconds = (stats_now_ns() - BeginNs) / 1e9;
+    int Frames = Ok ? State->FrameIndex : -1;
+    *Error = State->Error;
+    delete State;
+    return Frames;
+}
+
+static void bench_video(const std::string& SrcFile, ocr_engine_t* Engine) {
+    options_t Options;
+    init_options(&Options);
+    Options.DumpFrames = false;
+    Options.FlushMode = FLUSH_END;
+
+    std::vector<recorded_event_t> Produced;
+    double Seconds;
+    std::string Error;
+    int Frames = scan_video_events(Engine, &Options, SrcFile, &Produced, &Seconds, &Error);
+    if (Frames < 0) {
+        LOGERROR("%s: %s\n", SrcFile.c_str(), Error.c_str());
+        return;
+    }
+    std::string Name = std::filesystem::path(SrcFile).filename().string();
+    OUTPUT("%-24s %-12s %12d frames %9.2f s %12.1f fps", "end to end", Name.c_str(), Frames, Seconds, Seconds > 0 ? Frames / Seconds : 0.0);
+
+    std::vector<recorded_event_t> Expected;
+    if (read_events_file(expected_events_path(SrcFile), &Expected)) {
+        event_score_t Score = score_events(Expected, Produced, EVAL_FRAME_TOLERANCE, EVAL_MIN_SIMILARITY);
+        OUTPUT("%-24s %-12s %5d expected %5d produced %5d matched, precision %.3f recall %.3f", "detection", Name.c_str(),
+               Score.Expected, Score.Produced, Score.Matched, precision(&Score), recall(&Score));
+    }
+}
+
+struct verify_budget_t {
+    int FrameTolerance;
+    double MinSimilarity;
+    double MinPrecision;
+    double MinRecall;
+    double BaselineFps;
+    double MaxSlowdown;
+};
+
+// NOTE: <corpus>/budget.txt holds "<key> <value>" lines, keys that are missing keep their defaults
+static void load_verify_budget(const std::string& Path, verify_budget_t* Budget) {
+    Budget->FrameTolerance = EVAL_FRAME_TOLERANCE;
+    Budget->MinSimilarity = EVAL_MIN_SIMILARITY;
+    Budget->MinPrecision = 0.95;
+    Budget->MinRecall = 0.95;
+    Budget->BaselineFps = 0;
+    Budget->MaxSlowdown = 0.1;
+
+    FILE* File = fopen(Path.c_str(), "r");
+    if (!File) {
+        LOGWARN("No budget file %s, using the defaults\n", Path.c_str());
+        return;
+    }
+    char Line[256];
+    while (fgets(Line, sizeof(Line), File)) {
+        char Key[64];
+        double Value;
+        if (Line[0] == '#' || sscanf(Line, "%63s %lf", Key, &Value) != 2) {
+            continue;
+        }
+        if (strcmp(Key, "frame_tolerance") == 0) {
+            Budget->FrameTolerance = (int)Value;
+        }
+        else if (strcmp(Key, "min_similarity") == 0) {
+            Budget->MinSimilarity = Value;
+        }
+        else if (strcmp(Key, "min_precision") == 0) {
+            Budget->MinPrecision = Value;
+        }
+        else if (strcmp(Key, "min_recall") == 0) {
+            Budget->MinRecall = Value;
+        }
+        else if (strcmp(Key, "baseline_fps") == 0) {
+            Budget->BaselineFps = Value;
+        }
+        else if (strcmp(Key, "max_slowdown") == 0) {
+            Budget->MaxSlowdown = Value;
+        }
+        else {
+            LOGWARN("Ignoring unknown budget %s\n", Key);
+        }
+    }
+    fclose(File);
+}
+
+// NOTE: Scans twice into the same events file, the second time with --resume but without a checkpoint.
+// That scan starts over and has to replace the events of the first one instead of appending to them.
+static bool verify_resume_without_checkpoint(ocr_engine_t* Engine, const options_t* Defaults, const std::string& SrcFile) {
+    std::error_code Error;
+    options_t Options = *Defaults;
+    Options.Format = OUTPUT_JSONL;
+    Options.OutputDir = (std::filesystem::temp_directory_path(Error) / "void_archives_verify").string();
+    std::filesystem::remove_all(Options.OutputDir, Error);
+    std::filesystem::create_directories(Options.OutputDir, Error);
+    std::string EventsPath = Options.OutputDir + "/events.jsonl";
+
+    size_t Counts[2] = {};
+    bool Ok = true;
+    for (int Run = 0; Ok && Run < 2; Run++) {
+        Options.Resume = Run == 1;
+        FILE* EventsFile = fopen(EventsPath.c_str(), Options.Resume ? "ab" : "wb");
+        Ok = EventsFile != 0;
+        if (!Ok) {
             break;
-        default:
-            LOGMSG("Type %d not implemented!");
         }
+        event_sink_t Sink;
+        open_event_sink(&Sink, Options.Format, EventsFile, std::filesystem::path(SrcFile).stem().string());
+        state_t* State = new state_t;
+        init_state(State, Engine, &Options);
+        State->Sink = &Sink;
+        Ok = scan_video(State, SrcFile.c_str());
+        delete State;
+        close_event_sink(&Sink);
+        fclose(EventsFile);
+
+        std::vector<recorded_event_t> Events;
+        Ok = Ok && read_events_file(EventsPath, &Events);
+        Counts[Run] = Events.size();
     }
+    std::filesystem::remove_all(Options.OutputDir, Error);
+    return Ok && Counts[0] == Counts[1];
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        LOGMSG("Expected 1 argument but got %d\n", argc - 1);
-        return 0;
+// NOTE: A reference frame is named after the screen or battle it shows (stigmata.png, abyss_battle_2.png, none.png
+// for a frame that must not match anything). If a <name>.expected.jsonl lies next to it, the ROIs of the frame are
+// read and scored against it as well.
+static const screen_signature_t* type_signature(int Type) {
+    return Type < SCREEN_COUNT ? ScreenSignatures + Type : BattleSignatures + Type - SCREEN_COUNT;
+}
+
+static int reference_frame_type(const std::string& Stem, int* Screen, int* Battle) {
+    *Screen = SCREEN_NONE;
+    *Battle = BATTLE_NONE;
+    for (int Type = 0; Type < SCREEN_COUNT + BATTLE_COUNT; Type++) {
+        const char* Name = type_signature(Type)->Name;
+        size_t Length = strlen(Name);
+        if (Stem.compare(0, Length, Name) == 0 && (Stem.size() == Length || Stem[Length] == '_')) {
+            if (Type < SCREEN_COUNT) {
+                *Screen = Type;
+            }
+            else {
+                *Battle = Type - SCREEN_COUNT;
+            }
+            return Type;
+        }
+    }
+    return Stem.compare(0, 4, "none") == 0 && (Stem.size() == 4 || Stem[4] == '_') ? SCREEN_COUNT + BATTLE_COUNT : -1;
+}
+
+// NOTE: Checks the signature and ROI tables against CorpusDir/frames, every measured screen and battle needs at least
+// one frame. Frames of unmeasured ones are skipped, they can't be classified.
+static bool verify_reference_frames(ocr_engine_t* Engine, const options_t* Options, const std::string& CorpusDir, const verify_budget_t* Budget) {
+    std::string FramesDir = CorpusDir + "/frames";
+    std::error_code Error;
+    if (!std::filesystem::is_directory(FramesDir, Error)) {
+        LOGWARN("No reference frames in %s, the screen signatures and ROIs are unchecked\n", FramesDir.c_str());
+        return true;
     }
 
-    LOGMSG("Using OpenCV version %s\n", cv::getVersionString());
+    std::vector<std::string> Files;
+    for (std::filesystem::directory_iterator It(FramesDir, Error); !Error && It != std::filesystem::directory_iterator(); It.increment(Error)) {
+        std::string Extension = It->path().extension().string();
+        if (Extension == ".png" || Extension == ".jpg") {
+            Files.push_back(It->path().string());
+        }
+    }
+    std::sort(Files.begin(), Files.end());
+
+    bool Covered[SCREEN_COUNT + BATTLE_COUNT] = {};
+    bool Ok = true;
+    for (size_t i = 0; i < Files.size(); i++) {
+        std::string Name = std::filesystem::relative(Files[i], CorpusDir).string();
+        int Screen, Battle;
+        int Type = reference_frame_type(std::filesystem::path(Files[i]).stem().string(), &Screen, &Battle);
+        cv::Mat Frame = cv::imread(Files[i], cv::IMREAD_COLOR);
+        if (Type < 0 || Frame.empty()) {
+            OUTPUT("FAIL %s: %s", Name.c_str(), Type < 0 ? "not named after a screen, a battle or none" : "could not read the frame");
+            Ok = false;
+            continue;
+        }
+        if (Type < SCREEN_COUNT + BATTLE_COUNT && !type_signature(Type)->Measured) {
+            OUTPUT("skip %s: %s is not measured", Name.c_str(), type_signature(Type)->Name);
+            continue;
+        }
 
-    state_t State;
-    State.Width = 1920;
-    State.Height = 1080;
-    State.HadStigmataScreenIndicator = false;
-    State.HadLineupScreenIndicator = false;
+        const viewport_t Viewport = full_viewport(Frame);
+        int FoundScreen = classify_screen(&Frame, &Viewport);
+        int FoundBattle = FoundScreen == SCREEN_NONE ? classify_battle(&Frame, &Viewport) : BATTLE_NONE;
+        if (FoundScreen != Screen || FoundBattle != Battle) {
+            const char* Found = FoundScreen != SCREEN_NONE ? ScreenSignatures[FoundScreen].Name : FoundBattle != BATTLE_NONE ? BattleSignatures[FoundBattle].Name : "none";
+            OUTPUT("FAIL %s: classified as %s", Name.c_str(), Found);
+            Ok = false;
+            continue;
+        }
+        if (Type < SCREEN_COUNT + BATTLE_COUNT) {
+            Covered[Type] = true;
+        }
 
-    if (State.Tess.Init(".", "eng")) {
-        LOGMSG("Could not initialize tesseract\n");
-        return -1;
+        std::vector<recorded_event_t> Expected;
+        if (!read_events_file(expected_events_path(Files[i]), &Expected)) {
+            OUTPUT("ok   %s", Name.c_str());
+            continue;
+        }
+        std::vector<recorded_event_t> Produced;
+        event_sink_t Sink;
+        Sink.Write = collect_event;
+        Sink.Flush = 0;
+        Sink.File = 0;
+        Sink.User = &Produced;
+        Sink.Next = 0;
+        state_t* State = new state_t;
+        init_state(State, Engine, Options);
+        State->Sink = &Sink;
+        State->Viewport = Viewport;
+        if (Screen != SCREEN_NONE) {
+            begin_screen(State, &Frame, Screen);
+            finish_ocr_scan(State);
+        }
+        else if (Battle != BATTLE_NONE) {
+            State->Battle.Battle = Battle;
+            read_battle_fields(State, &Frame);
+        }
+        flush_events(State, false);
+        bool OcrFailed = State->OcrFailed;
+        delete State;
+
+        event_score_t Score = score_events(Expected, Produced, Budget->FrameTolerance, Budget->MinSimilarity);
+        bool Matched = !OcrFailed && Score.Matched == Score.Expected;
+        OUTPUT("%s %s: %d/%d expected, %d produced", Matched ? "ok  " : "FAIL", Name.c_str(), Score.Matched, Score.Expected, Score.Produced);
+        Ok = Ok && Matched;
     }
 
-    State.Tess.SetPageSegMode(tesseract::PageSegMode::PSM_SINGLE_BLOCK);
-    State.Tess.SetVariable("save_best_choices", "T");
-    State.Tess.SetVariable("user_defined_dpi", "300");
+    for (int Type = 0; Type < SCREEN_COUNT + BATTLE_COUNT; Type++) {
+        if (type_signature(Type)->Measured && !Covered[Type]) {
+            OUTPUT("FAIL no reference frame for %s", type_signature(Type)->Name);
+            Ok = false;
+        }
+    }
+    return Ok;
+}
 
-    LOGMSG("Initialized tesseract %s %s\n", State.Tess.Version(), State.Tess.GetInitLanguagesAsString());
+// NOTE: Scans every labeled video of the corpus sequentially on one engine, so that the throughput is
+// comparable between runs. Fails if accuracy or fps fall below the budget.
+// NOTE: The resume check costs two more full scans, it is opt-in and runs on the first clip after the timed scans.
+static int run_verify(const std::string& CorpusDir, bool CheckResume) {
+    verify_budget_t Budget;
+    load_verify_budget(CorpusDir + "/budget.txt", &Budget);
 
-    std::string SrcFile = argv[1];
-    State.Capture.open(SrcFile);
-    if (!State.Capture.isOpened()) {
-        LOGMSG("Could not open file %s\n", SrcFile.c_str());
-        return -1;
+    std::vector<std::string> Inputs(1, CorpusDir);
+    std::vector<std::string> Files;
+    collect_batch_inputs(Inputs, &Files);
+
+    options_t Options;
+    init_options(&Options);
+    Options.DumpFrames = false;
+    Options.FlushMode = FLUSH_END;
+    ocr_engine_t* Engine = create_ocr_engines(1, false);
+
+    event_score_t Total = { 0, 0, 0 };
+    int64_t TotalFrames = 0;
+    double TotalSeconds = 0;
+    int Clips = 0;
+    std::string FirstClip;
+    bool Failed = false;
+    for (size_t i = 0; i < Files.size(); i++) {
+        std::vector<recorded_event_t> Expected;
+        if (!read_events_file(expected_events_path(Files[i]), &Expected)) {
+            continue;
+        }
+
+        std::vector<recorded_event_t> Produced;
+        double Seconds;
+        std::string Error;
+        int Frames = scan_video_events(Engine, &Options, Files[i], &Produced, &Seconds, &Error);
+        std::string Name = std::filesystem::relative(Files[i], CorpusDir).string();
+        if (Frames < 0) {
+            OUTPUT("FAIL %s: %s", Name.c_str(), Error.c_str());
+            Failed = true;
+            continue;
+        }
+
+        event_score_t Score = score_events(Expected, Produced, Budget.FrameTolerance, Budget.MinSimilarity);
+        OUTPUT("%s %s: %d/%d expected, %d produced, precision %.3f recall %.3f, %.1f fps", Score.Matched == Score.Expected && Score.Matched == Score.Produced ? "ok  " : "diff",
+               Name.c_str(), Score.Matched, Score.Expected, Score.Produced, precision(&Score), recall(&Score), Seconds > 0 ? Frames / Seconds : 0.0);
+        Total.Expected += Score.Expected;
+        Total.Produced += Score.Produced;
+        Total.Matched += Score.Matched;
+        TotalFrames += Frames;
+        TotalSeconds += Seconds;
+        if (Clips++ == 0) {
+            FirstClip = Files[i];
+        }
+    }
+    if (CheckResume && !FirstClip.empty() && !verify_resume_without_checkpoint(Engine, &Options, FirstClip)) {
+        OUTPUT("FAIL %s: resume without a checkpoint duplicated events", std::filesystem::relative(FirstClip, CorpusDir).string().c_str());
+        Failed = true;
     }
+    if (!verify_reference_frames(Engine, &Options, CorpusDir, &Budget)) {
+        Failed = true;
+    }
+    delete[] Engine;
 
-    LOGMSG("Streaming video file from %s\n", SrcFile.c_str());
+    if (Clips == 0) {
+        LOGERROR("No labeled videos in %s\n", CorpusDir.c_str());
+        return 1;
+    }
+    double Fps = TotalSeconds > 0 ? TotalFrames / TotalSeconds : 0.0;
+    OUTPUT("%d clips: precision %.3f (min %.3f), recall %.3f (min %.3f), %.1f fps (baseline %.1f, max slowdown %.0f%%)", Clips,
+           precision(&Total), Budget.MinPrecision, recall(&Total), Budget.MinRecall, Fps, Budget.BaselineFps, 100 * Budget.MaxSlowdown);
+    if (precision(&Total) < Budget.MinPrecision) {
+        OUTPUT("FAIL precision below budget");
+        Failed = true;
+    }
+    if (recall(&Total) < Budget.MinRecall) {
+        OUTPUT("FAIL recall below budget");
+        Failed = true;
+    }
+    if (Budget.BaselineFps > 0 && Fps < Budget.BaselineFps * (1 - Budget.MaxSlowdown)) {
+        OUTPUT("FAIL throughput below budget");
+        Failed = true;
+    }
+    OUTPUT(Failed ? "FAILED" : "PASSED");
+    return Failed ? 1 : 0;
+}
 
-#if WITH_VIDEO
-    const char* WinName = "Test";
-    cv::namedWindow(WinName, cv::WINDOW_AUTOSIZE);
-    cv::moveWindow(WinName, 0, 0);
-#endif
+struct synth_options_t {
+    std::string OutputDir;
+    int Seconds;
+    int Fps;
+    int Width;
+    int Height;
+    int Noise;
+    int Quality;
+    int Seed;
+};
 
-    const float StigmataScreenThresholdConfidence = 0.97f;
-    const test_pixel_t StigmataScreenIndicators[] = {
-        {  120, 200, 0xee, 0x9a, 0xff },
-        {  990, 864, 0xff, 0xdd, 0x47 },
-        { 1350, 864, 0xff, 0xdd, 0x47 },
-        { 1710, 864, 0xff, 0xdd, 0x47 },
-        { 1280, 974, 0x00, 0xc9, 0xff },
-    };
+static void init_synth_options(synth_options_t* Synth) {
+    Synth->OutputDir = ".";
+    Synth->Seconds = 120;
+    Synth->Fps = 30;
+    Synth->Width = 1920;
+    Synth->Height = 1080;
+    Synth->Noise = 6;
+    Synth->Quality = 75;
+    Synth->Seed = 1;
+}
 
-    const float LineupScreenThresholdConfidence = 0.97f;
-    const test_pixel_t LineupScreenIndicators[] = {
-        { 1762, 168, 0xff, 0xdd, 0x47 },
-        { 1762, 390, 0xff, 0xdd, 0x47 },
-        { 1762, 608, 0xff, 0xdd, 0x47 },
-        {  181,  97, 0xff, 0xdb, 0x48 },
-        { 1520, 986, 0x00, 0x5a, 0x7e },
+// NOTE: Returns false for keys that are not generator options
+static bool parse_synth_option(synth_options_t* Synth, const char* Key, const char* Value) {
+    if (strcmp(Key, "generate") == 0) {
+        Synth->OutputDir = *Value ? Value : ".";
+    }
+    else if (strcmp(Key, "seconds") == 0) {
+        Synth->Seconds = std::max(atoi(Value), 1);
+    }
+    else if (strcmp(Key, "fps") == 0) {
+        Synth->Fps = std::max(atoi(Value), 1);
+    }
+    else if (strcmp(Key, "resolution") == 0) {
+        sscanf(Value, "%dx%d", &Synth->Width, &Synth->Height);
+    }
+    else if (strcmp(Key, "noise") == 0) {
+        Synth->Noise = clamp(atoi(Value), 0, 127);
+    }
+    else if (strcmp(Key, "quality") == 0) {
+        Synth->Quality = clamp(atoi(Value), 1, 100);
+    }
+    else if (strcmp(Key, "seed") == 0) {
+        Synth->Seed = atoi(Value);
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// NOTE: Light text on a dark box, word wrapped and shrunk until it fits like the game does with long names
+static void draw_text_box(cv::Mat* Frame, const rect_t* Box, const std::string& Text) {
+    cv::rectangle(*Frame, cv::Rect(Box->X, Box->Y, Box->Width, Box->Height), cv::Scalar(30, 24, 20), cv::FILLED);
+    const int Font = cv::FONT_HERSHEY_DUPLEX;
+    const int Margin = 8;
+    for (double Scale = 1.2; Scale > 0.3; Scale -= 0.1) {
+        std::vector<std::string> Lines(1);
+        size_t Start = 0;
+        while (Start < Text.size()) {
+            size_t End = Text.find(' ', Start);
+            std::string Word = Text.substr(Start, End == std::string::npos ? std::string::npos : End - Start);
+            Start = End == std::string::npos ? Text.size() : End + 1;
+            std::string Line = Lines.back().empty() ? Word : Lines.back() + " " + Word;
+            int Baseline;
+            if (Lines.back().empty() || cv::getTextSize(Line, Font, Scale, 2, &Baseline).width <= Box->Width - 2 * Margin) {
+                Lines.back() = Line;
+            }
+            else {
+                Lines.push_back(Word);
+            }
+        }
+
+        int Baseline;
+        cv::Size LineSize = cv::getTextSize(Text, Font, Scale, 2, &Baseline);
+        int LineHeight = LineSize.height + Baseline + 4;
+        bool Fits = (int)Lines.size() * LineHeight <= Box->Height - 2 * Margin;
+        for (size_t i = 0; Fits && i < Lines.size(); i++) {
+            Fits = cv::getTextSize(Lines[i], Font, Scale, 2, &Baseline).width <= Box->Width - 2 * Margin;
+        }
+        if (Fits) {
+            int Y = Box->Y + (Box->Height - (int)Lines.size() * LineHeight) / 2 + LineSize.height;
+            for (size_t i = 0; i < Lines.size(); i++, Y += LineHeight) {
+                cv::putText(*Frame, Lines[i], cv::Point(Box->X + Margin, Y), Font, Scale, cv::Scalar(240, 240, 240), 2, cv::LINE_AA);
+            }
+            return;
+        }
+    }
+}
+
+// NOTE: Writes <dir>/synthetic.avi (MJPG at the given quality) and the events it should produce to
+// <dir>/synthetic.expected.jsonl. Screens are rendered at 1920x1080 and scaled to the output resolution.
+static int run_generate(const synth_options_t* Synth) {
+    static const char* Valkyries[] = {
+        "Herrscher of Flamescion", "Herrscher of Thunder", "Starchasm Nyx", "Reign Solaris", "Sentience of the Sky", "Lone Planetwalker",
+    };
+    static const char* StigmataSets[] = {
+        "Tesla: Bolt Thrower", "Elysia: Miss Pink Elf", "Schrodinger", "Kafka", "Welt Yang", "Hawking", "Thales",
     };
+    static const char* Weapons[] = {
+        "Domain of Sustention", "Key of Reason", "Skadi Ondurgud", "Fenghuang of Vicissitude", "Elysian Flower",
+    };
+    static const char* DivineKeys[] = {
+        "Key of Castigation", "Key to the Deep", "Key of Radiance", "Key of Cosmic Void",
+    };
+    static const char* Ranks[] = { "A", "S", "SS", "SSS" };
+    static const char* Elves[] = { "Jingwei's Wings", "Blade Kitten" };
+    static const char* Slots[] = { " (T)", " (M)", " (B)" };
+
+    std::error_code Error;
+    std::filesystem::create_directories(Synth->OutputDir, Error);
+    std::string VideoPath = Synth->OutputDir + "/synthetic.avi";
+    cv::VideoWriter Writer;
+    if (!Writer.open(VideoPath, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), Synth->Fps, cv::Size(Synth->Width, Synth->Height))) {
+        LOGERROR("Could not write %s\n", VideoPath.c_str());
+        return 1;
+    }
+    Writer.set(cv::VIDEOWRITER_PROP_QUALITY, Synth->Quality);
+    FILE* ExpectedFile = fopen(expected_events_path(VideoPath).c_str(), "wb");
+    if (!ExpectedFile) {
+        LOGERROR("Could not write %s\n", expected_events_path(VideoPath).c_str());
+        return 1;
+    }
+    event_sink_t Sink;
+    open_event_sink(&Sink, OUTPUT_JSONL, ExpectedFile, "synthetic");
 
-    const cv::Size TargetSize = cv::Size(State.Width, State.Height);
-    LOGMSG("Framerate: %d\nFrame count: %d\n", (int)State.Capture.get(cv::CAP_PROP_FPS), (int)State.Capture.get(cv::CAP_PROP_FRAME_COUNT));
-    LOGMSG("Stigmata screen threshold confidence value: %.6f\n", StigmataScreenThresholdConfidence);
-    LOGMSG("Lineup screen threshold confidence value: %.6f\n", LineupScreenThresholdConfidence);
+    cv::RNG Rng(Synth->Seed);
+    cv::Mat Background(1080, 1920, CV_8UC3);
+    cv::randu(Background, cv::Scalar::all(16), cv::Scalar::all(72));
+    cv::GaussianBlur(Background, Background, cv::Size(31, 31), 0);
 
+    cv::Mat Screen;
+    cv::Mat Hud[BATTLE_COUNT];
+    for (int Battle = 0; Battle < BATTLE_COUNT; Battle++) {
+        Background.copyTo(Hud[Battle]);
+        draw_screen_indicators(&Hud[Battle], BattleSignatures + Battle);
+    }
     cv::Mat Frame;
-    for (State.Capture >> Frame; !Frame.empty(); State.Capture >> Frame) {
-        cv::Mat ResizedFrame;
-        cv::Mat* RefFrame = &Frame;
-        assert(Frame.isContinuous());
-        if (Frame.isContinuous()) {
-            if (Frame.size() != TargetSize) {
-                cv::resize(Frame, ResizedFrame, TargetSize);
-                RefFrame = &ResizedFrame;
+    cv::Mat Noise(1080, 1920, CV_8UC3);
+    int ScreenEnd = -1;
+    int BattleBegin = -1;
+    int BattleEnd = -1;
+    int Battle = BATTLE_NONE;
+    int NextScreen[SCREEN_COUNT];
+    const int PeriodFrames = SYNTH_PERIOD_SECONDS * Synth->Fps;
+    const int FrameCount = Synth->Seconds * Synth->Fps;
+    int Screens = 0;
+    for (int FrameIndex = 0; FrameIndex < FrameCount; FrameIndex++) {
+        if (FrameIndex % PeriodFrames == 0) {
+            NextScreen[SCREEN_STIGMATA] = FrameIndex + Rng.uniform(3 * Synth->Fps, 5 * Synth->Fps);
+            NextScreen[SCREEN_WEAPON] = FrameIndex + Rng.uniform(8 * Synth->Fps, 10 * Synth->Fps);
+            NextScreen[SCREEN_DIVINE_KEY] = FrameIndex + Rng.uniform(13 * Synth->Fps, 14 * Synth->Fps);
+            NextScreen[SCREEN_LINEUP] = FrameIndex + Rng.uniform(17 * Synth->Fps, 18 * Synth->Fps);
+            Battle = (FrameIndex / PeriodFrames) % BATTLE_COUNT;
+            BattleBegin = FrameIndex + Synth->Fps / 2;
+            BattleEnd = BattleBegin + 2 * Synth->Fps;
+        }
+
+        event_t Event = {};
+        Event.Frame = FrameIndex;
+        Event.Ms = (int32_t)(1000.0 * FrameIndex / Synth->Fps);
+        Event.Confidence = 100;
+        bool BattleShown = BattleSignatures[Battle].Measured && BattleEnd <= FrameCount;
+        if (BattleShown && (FrameIndex == BattleBegin || FrameIndex == BattleEnd - 1)) {
+            Event.Type = BattleSignatures[Battle].EventType;
+            Sink.Write(&Sink, &Event, FrameIndex == BattleBegin ? "start" : "end");
+        }
+        for (int ScreenIndex = 0; ScreenIndex < SCREEN_COUNT; ScreenIndex++) {
+            int Duration = (ScreenIndex == SCREEN_LINEUP ? 1 : 2) * Synth->Fps;
+            if (!ScreenSignatures[ScreenIndex].Measured || FrameIndex != NextScreen[ScreenIndex] || FrameIndex + Duration > FrameCount) {
+                continue;
             }
 
-            bool check = true;
-            if (check && screen_test(RefFrame, TargetSize, StigmataScreenIndicators, ARRAY_COUNT(StigmataScreenIndicators), StigmataScreenThresholdConfidence)) {
-                check = false;
-                if (!State.HadStigmataScreenIndicator) {
-                    State.HadStigmataScreenIndicator = true;
-                    scan_stigmata_screen(&State, RefFrame);
+            Background.copyTo(Screen);
+            draw_screen_indicators(&Screen, ScreenSignatures + ScreenIndex);
+            Event.Type = ScreenSignatures[ScreenIndex].EventType;
+            Sink.Write(&Sink, &Event, "");
+
+            int RoiCount;
+            const ocr_roi_layout_t* Layout = screen_rois(ScreenIndex, &RoiCount);
+            int Slot = 0;
+            for (int i = 0; i < RoiCount; i++) {
+                if (!Layout[i].Measured) {
+                    continue;
+                }
+                std::string Value;
+                switch (Layout[i].EventType) {
+                case EVENT_VALKYRIE_NAME: Value = Valkyries[Rng.uniform(0, (int)ARRAY_COUNT(Valkyries))]; break;
+                case EVENT_STIGMATA:      Value = std::string(StigmataSets[Rng.uniform(0, (int)ARRAY_COUNT(StigmataSets))]) + Slots[Slot++ % 3]; break;
+                case EVENT_WEAPON:        Value = Weapons[Rng.uniform(0, (int)ARRAY_COUNT(Weapons))]; break;
+                case EVENT_DIVINE_KEY:    Value = DivineKeys[Rng.uniform(0, (int)ARRAY_COUNT(DivineKeys))]; break;
+                case EVENT_VALKYRIE_RANK: Value = Ranks[Rng.uniform(0, (int)ARRAY_COUNT(Ranks))]; break;
+                case EVENT_ELF:           Value = Elves[Rng.uniform(0, (int)ARRAY_COUNT(Elves))]; break;
+                default: break;
                 }
+                draw_text_box(&Screen, &Layout[i].Box, Value);
+                Event.Type = Layout[i].EventType;
+                Sink.Write(&Sink, &Event, Value.c_str());
             }
-            else {
-                State.HadStigmataScreenIndicator = false;
+            ScreenEnd = FrameIndex + Duration;
+            Screens++;
+        }
+
+        const cv::Mat* Source = FrameIndex < ScreenEnd ? &Screen : &Background;
+        if (BattleShown && FrameIndex >= BattleBegin && FrameIndex < BattleEnd) {
+            Source = &Hud[Battle];
+        }
+        if (Synth->Noise > 0) {
+            cv::randu(Noise, cv::Scalar::all(0), cv::Scalar::all(2 * Synth->Noise + 1));
+            cv::add(*Source, Noise, Frame);
+            cv::subtract(Frame, cv::Scalar::all(Synth->Noise), Frame);
+        }
+        else {
+            Source->copyTo(Frame);
+        }
+        if (Frame.size() != cv::Size(Synth->Width, Synth->Height)) {
+            cv::resize(Frame, Frame, cv::Size(Synth->Width, Synth->Height), 0, 0, cv::INTER_AREA);
+        }
+        Writer.write(Frame);
+    }
+
+    Writer.release();
+    close_event_sink(&Sink);
+    fclose(ExpectedFile);
+    LOGMSG("Generated %s: %d frames, %d screens\n", VideoPath.c_str(), FrameCount, Screens);
+    return 0;
+}
+
+// NOTE: Runs every kernel on a synthetic 1080p frame (noise with the stigmata indicators, so the OCR ladder
+// runs to the end) and on every captured frame given on the command line. Videos are scanned end to end
+// and scored against their expected events if there are any.
+static int run_bench(const std::vector<std::string>& Inputs) {
+    ocr_engine_t* Engine = create_ocr_engines(1, false);
+    if (!acquire_tess(Engine)) {
+        LOGWARN("Benchmarking the stigmata screen scan without tesseract\n");
+    }
+
+    cv::Mat Synthetic(1080, 1920, CV_8UC3);
+    cv::randu(Synthetic, cv::Scalar::all(0), cv::Scalar::all(256));
+    draw_screen_indicators(&Synthetic, ScreenSignatures + SCREEN_STIGMATA);
+    bench_frame("synthetic", Synthetic, Engine);
+
+    for (size_t i = 0; i < Inputs.size(); i++) {
+        if (is_video_file(Inputs[i])) {
+            bench_video(Inputs[i], Engine);
+            continue;
+        }
+        cv::Mat Captured = cv::imread(Inputs[i], cv::IMREAD_COLOR);
+        if (Captured.empty()) {
+            LOGERROR("Could not read frame %s\n", Inputs[i].c_str());
+            continue;
+        }
+        if (Captured.size() != cv::Size(1920, 1080)) {
+            cv::resize(Captured, Captured, cv::Size(1920, 1080));
+        }
+        std::string FrameName = std::filesystem::path(Inputs[i]).filename().string();
+        bench_frame(FrameName.c_str(), Captured, Engine);
+    }
+
+    delete[] Engine;
+    return 0;
+}
+
+// NOTE: Prints the signature Name with the colors measured under its pixels, averaged over the frames
+// given. The output is a --signatures file section, that is how the provisional tables are replaced by measured values.
+static int run_measure(const std::string& Name, const std::vector<std::string>& Inputs) {
+    const screen_signature_t* Signature = find_signature(Name.c_str());
+    if (!Signature) {
+        LOGERROR("Unknown screen %s\n", Name.c_str());
+        return 1;
+    }
+
+    std::vector<int> PixelSums(3 * Signature->PixelCount, 0);
+    int Frames = 0;
+    for (size_t i = 0; i < Inputs.size(); i++) {
+        cv::Mat Frame = cv::imread(Inputs[i], cv::IMREAD_COLOR);
+        if (Frame.empty()) {
+            LOGERROR("Could not read frame %s\n", Inputs[i].c_str());
+            continue;
+        }
+        const viewport_t Viewport = full_viewport(Frame);
+        for (int p = 0; p < Signature->PixelCount; p++) {
+            const test_pixel_t* Pixel = Signature->Pixels + p;
+            const uchar* Color = Frame.ptr(map_y(&Viewport, Pixel->y), map_x(&Viewport, Pixel->x));
+            for (int Channel = 0; Channel < 3; Channel++) {
+                PixelSums[3 * p + Channel] += Color[2 - Channel];
             }
+        }
+        Frames++;
+    }
+    if (Frames == 0) {
+        LOGERROR("No frames to measure %s on\n", Name.c_str());
+        return 1;
+    }
 
-            if (check && screen_test(RefFrame, TargetSize, LineupScreenIndicators, ARRAY_COUNT(LineupScreenIndicators), LineupScreenThresholdConfidence)) {
-                check = false;
-                if (!State.HadLineupScreenIndicator) {
-                    State.HadLineupScreenIndicator = true;
-                    scan_lineup_screen(&State, RefFrame);
-                }
+    OUTPUT("# %s measured on %d frames", Signature->Name, Frames);
+    OUTPUT("screen %s %.2f", Signature->Name, Signature->Threshold);
+    for (int p = 0; p < Signature->PixelCount; p++) {
+        OUTPUT("pixel %d %d %02x%02x%02x", Signature->Pixels[p].x, Signature->Pixels[p].y,
+               PixelSums[3 * p] / Frames, PixelSums[3 * p + 1] / Frames, PixelSums[3 * p + 2] / Frames);
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    options_t Options;
+    init_options(&Options);
+    std::vector<std::string> Inputs;
+    bool Batch = false;
+    bool Bench = false;
+    std::string VerifyDir;
+    bool VerifyResume = false;
+    std::string MeasureName;
+    bool Generate = false;
+    synth_options_t Synth;
+    init_synth_options(&Synth);
+    std::string DaemonSocket;
+    std::string ClientSocket;
+    int ThreadCount = (int)std::thread::hardware_concurrency();
+    std::vector<std::string> JobOptions;
+    for (int i = 1; i < argc; i++) {
+        const char* Arg = argv[i];
+        if (strncmp(Arg, "--", 2) != 0) {
+            Inputs.push_back(Arg);
+            continue;
+        }
+
+        std::string Key = Arg + 2;
+        std::string Value;
+        size_t Eq = Key.find('=');
+        if (Eq != std::string::npos) {
+            Value = Key.substr(Eq + 1);
+            Key.resize(Eq);
+        }
+
+        if (Key == "daemon") {
+            DaemonSocket = Value;
+        }
+        else if (Key == "client") {
+            ClientSocket = Value;
+        }
+        else if (Key == "batch") {
+            Batch = true;
+        }
+        else if (Key == "bench") {
+            Bench = true;
+        }
+        else if (Key == "measure") {
+            MeasureName = Value;
+        }
+        else if (Key == "verify") {
+            VerifyDir = Value.empty() ? "." : Value;
+        }
+        else if (Key == "verify-resume") {
+            VerifyResume = true;
+        }
+        else if (parse_synth_option(&Synth, Key.c_str(), Value.c_str())) {
+            Generate = Generate || Key == "generate";
+        }
+        else if (Key == "threads") {
+            ThreadCount = atoi(Value.c_str());
+        }
+        else if (Key == "ocr-threads") {
+            OcrPool.ThreadCount = atoi(Value.c_str());
+        }
+        else if (Key == "log-level" && Value == "debug") {
+            LogLevel = LOG_LEVEL_DEBUG;
+        }
+        else if (Key == "log-level" && Value == "info") {
+            LogLevel = LOG_LEVEL_INFO;
+        }
+        else if (Key == "log-level" && Value == "warn") {
+            LogLevel = LOG_LEVEL_WARN;
+        }
+        else if (Key == "log-level" && Value == "error") {
+            LogLevel = LOG_LEVEL_ERROR;
+        }
+        else if (Key == "log-level" && Value == "none") {
+            LogLevel = LOG_LEVEL_NONE;
+        }
+        else if (Key == "trace") {
+            init_trace(Value);
+        }
+        else if (Key == "digits") {
+            if (!load_digit_templates(&DigitTemplates, Value.c_str())) {
+                return 0;
             }
-            else {
-                State.HadLineupScreenIndicator = false;
+        }
+        else if (Key == "capture-digits") {
+            std::error_code Error;
+            std::filesystem::create_directories(Value, Error);
+            if (Error) {
+                LOGERROR("Could not create %s\n", Value.c_str());
+                return 0;
             }
+            DigitCaptureDir = Value;
         }
-#if WITH_VIDEO
-        char c = (char)cv::waitKey(WAIT_DELAY_MS);
-        if (c == 27) return 0;
-        cv::imshow(WinName, *RefFrame);
-#endif
+        else if (Key == "divine-keys") {
+            if (!load_icon_library(&DivineKeyIcons, Value.c_str())) {
+                return 0;
+            }
+        }
+        else if (Key == "signatures") {
+            if (!load_screen_signatures(Value.c_str())) {
+                return 0;
+            }
+        }
+        else if (Key == "log-files" && Value == "shared") {
+            LogFiles = LOG_FILES_SHARED;
+        }
+        else if (Key == "log-files" && Value == "thread") {
+            LogFiles = LOG_FILES_THREAD;
+        }
+        else if (Key == "log-files" && Value == "job") {
+            LogFiles = LOG_FILES_JOB;
+        }
+        else if (!parse_option(&Options, Key.c_str(), Value.c_str())) {
+            return 0;
+        }
+        else {
+            JobOptions.push_back(Key + "=" + Value);
+        }
+    }
+    if (ThreadCount < 1) {
+        ThreadCount = 1;
+    }
+    // NOTE: Every batch file writes its own events.<ext>, and a daemon job takes events= from its job line
+    if (!Options.EventsPath.empty() && (Batch || !DaemonSocket.empty())) {
+        LOGERROR("--events can't be combined with --%s\n", Batch ? "batch" : "daemon");
+        return -1;
+    }
+    if (OcrPool.ThreadCount < 0) {
+        int Workers = Batch || !DaemonSocket.empty() ? ThreadCount : 1;
+        OcrPool.ThreadCount = clamp((int)std::thread::hardware_concurrency() - Workers, 0, OCR_POOL_MAX_THREADS);
     }
+    init_stats();
+    LOGMSG("Using OpenCV version %s\n", cv::getVersionString().c_str());
 
-    output_events(&State);
+    if (!DaemonSocket.empty()) {
+        return run_daemon(DaemonSocket.c_str(), ThreadCount, &Options);
+    }
 
-    return 0;
-}
\ No newline at end of file
+    if (Batch) {
+        return run_batch(Inputs, ThreadCount, &Options);
+    }
+
+    if (Generate) {
+        return run_generate(&Synth);
+    }
+
+    if (Bench) {
+        return run_bench(Inputs);
+    }
+
+    if (!VerifyDir.empty()) {
+        return run_verify(VerifyDir, VerifyResume);
+    }
+
+    if (!MeasureName.empty()) {
+        return run_measure(MeasureName, Inputs);
+    }
+
+    if (Inputs.size() != 1) {
+        LOGERROR("Expected 1 video file but got %d\n", (int)Inputs.size());
+        return 0;
+    }
+    const char* SrcFile = Inputs[0].c_str();
+
+    if (!ClientSocket.empty()) {
+        return run_client(ClientSocket.c_str(), SrcFile, JobOptions);
+    }
+
+    // NOTE: Tesseract is initialized lazily by the first OCR request, recordings without any screens never pay for it
+    ocr_engine_t Ocr;
+    init_ocr_engine_slot(&Ocr);
+
+    FILE* EventsFile = 0;
+    if (!Options.EventsPath.empty()) {
+        EventsFile = fopen(Options.EventsPath.c_str(), Options.Resume ? "ab" : "wb");
+        if (!EventsFile) {
+            LOGERROR("Could not open %s\n", Options.EventsPath.c_str());
+            return -1;
+        }
+        fseek(EventsFile, 0, SEEK_END);
+    }
+    event_sink_t Sink;
+    open_event_sink(&Sink, Options.Format, EventsFile, std::filesystem::path(SrcFile).stem().string());
+    Sink.Next = attach_clip_sink(&Options, SrcFile, attach_database_sink(&Options, SrcFile));
+
+    state_t* State = new state_t;
+    init_state(State, &Ocr, &Options);
+    State->Sink = &Sink;
+    bool Ok = scan_video(State, SrcFile);
+    detach_database_sink(detach_clip_sink(Sink.Next));
+    close_event_sink(&Sink);
+    if (EventsFile) {
+        fclose(EventsFile);
+    }
+    delete State;
+
+    return Ok ? 0 : -1;
+}